@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -6,12 +7,22 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <sys/syscall.h>
+#include <link.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "muncher.h"
 #include <unistd.h>
 
-#define UNTAG(p) (((uintptr_t) (p)) & 0xfffffffc)
 #define MIN_ALLOC_SIZE 4096 /* We allocate blocks in page sized chunks. */
 
 // NOTE: credit for skeleton code for basic mark and sweep to Matthew Plant (https://maplant.com/2020-04-25-Writing-a-Simple-Garbage-Collector-in-C.html)
@@ -19,28 +30,424 @@
 
 typedef struct header {
     unsigned int    size;
-    unsigned int    original_size;
     //unsigned int ref_count;
     struct header   *next;
-    uintptr_t mmap_addr;
 } header_t;
 
 
-static header_t base;           /* Zero sized block to get us started. */
-static header_t *freep = &base; /* Points to first free block of memory. */
+/*
+ * The collector's own variables that hold heap addresses go in a section of their own,
+ * which the data segment scan leaves out. Otherwise heap_lo, which is also the address
+ * of the first block's header, would keep that block alive for good, and heap_frontier
+ * would get a page past the frontier blacklisted at every collection.
+ */
+#define MUNCH_PRIVATE __attribute__((section("munch_private")))
+extern char __start_munch_private[], __stop_munch_private[];
+
+static header_t base MUNCH_PRIVATE;           /* Zero sized block to get us started. */
+static header_t *freep MUNCH_PRIVATE = &base; /* Points to first free block of memory. */
 //static header_t *freep = NULL; /* Points to first free block of memory. */
-static header_t *usedp;         /* Points to first used block of memory. */
 
-static uintptr_t stack_bottom;
+/*
+ * Small objects live in slab pages ("big bag of pages"): every page holds objects of a
+ * single size class and nothing else, so objects carry no header at all. Everything we
+ * need to know about a page, including which slots are allocated, lives out of line in
+ * its page_info_t. Bitmaps have one bit per 16 byte granule and the bit for an object is
+ * the one for its first granule.
+ *
+ * Requests up to MAX_SMALL_SIZE are rounded up to one of the classes below. Anything
+ * bigger, or of an odd size, still goes through the first-fit freep list.
+ */
+#define HEAP_PAGE_SHIFT 12
+#define HEAP_PAGE_SIZE (1UL << HEAP_PAGE_SHIFT)
+#define GRANULE_SHIFT 4
+#define PAGE_GRANULES (HEAP_PAGE_SIZE >> GRANULE_SHIFT)
+#define BITMAP_WORDS (PAGE_GRANULES / 64)
+
+#define NUM_SIZE_CLASSES 20
+#define MAX_SMALL_SIZE 1024
+static const unsigned int class_size[NUM_SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024
+};
+static unsigned char size_class[(MAX_SMALL_SIZE >> GRANULE_SHIFT) + 1]; /* granules -> class */
+
+/*
+ * Atomic objects get slab pages of their own, so that those pages can go where a false
+ * pointer has been seen (see black_pages). Page lists and allocation buffers are indexed
+ * by size class, plus NUM_SIZE_CLASSES for the atomic pages of that class.
+ */
+#define NUM_SLAB_LISTS (2 * NUM_SIZE_CLASSES)
+#define CLASS_SIZE(c) class_size[(c) % NUM_SIZE_CLASSES]
+
+enum { PAGE_FREE, PAGE_SLAB, PAGE_BLOCK /* header_t blocks */ };
+
+typedef struct page_info {
+    struct page_info *next;     /* next page on empty_pages or a class_pages list */
+    char *base;                 /* address of the page itself */
+    void *free;                 /* free slots, threaded through their first word */
+    char *bump;                 /* slots from here to the end have never been used */
+    header_t *block;            /* PAGE_BLOCK: last used block allocated over our start */
+    unsigned short obj_size;
+    unsigned short nobjs;
+    unsigned char kind;
+    unsigned char size_class;   /* the list it goes on: see NUM_SLAB_LISTS */
+    unsigned char in_nursery;
+    unsigned char skip_sweep;   /* see tlab_refill */
+    unsigned char fresh;        /* straight from the arena: slots past bump are still zero */
+    unsigned char black;        /* handed out blacklisted, so only fit for atomic objects */
+    struct page_info *nursery_next;
+    uint64_t alloc_bits[BITMAP_WORDS];
+    uint64_t noscan_bits[BITMAP_WORDS]; /* objects from munch_alloc_atomic, set as they're allocated */
+    uint64_t typed_bits[BITMAP_WORDS];  /* objects from munch_alloc_typed, likewise */
+} page_info_t;
+
+/*
+ * The heap is one big range of address space reserved (PROT_NONE) up front and committed
+ * ARENA_CHUNK_SIZE at a time as it grows. Pages are handed out from heap_frontier upward,
+ * to slab pages and to the header_t free list alike, and page_table holds the page_info_t
+ * for every page in the reservation, so any address in [heap_lo, heap_frontier) finds its
+ * page with a subtraction and a shift.
+ */
+#define ARENA_CHUNK_SIZE (4UL * 1024 * 1024)
+
+static char *heap_lo MUNCH_PRIVATE, *heap_hi MUNCH_PRIVATE; /* the reservation */
+static char *heap_committed MUNCH_PRIVATE; /* end of the readable/writable part */
+static char *heap_frontier MUNCH_PRIVATE;  /* end of the pages handed out so far */
+static page_info_t *page_table;
+
+#define PAGE_INDEX(p) (((uintptr_t) (p) - (uintptr_t) heap_lo) >> HEAP_PAGE_SHIFT)
+
+/*
+ * Which addresses keep an object alive: any address inside it (the default), only its
+ * start, or its start and the interior_prefix bytes after it. A pointer to a header_t
+ * block's header always counts, see find_block.
+ */
+static int interior_mode = MUNCH_INTERIOR_ALL;
+static size_t interior_prefix;
+
+/*
+ * Mark state never touches the heap itself. Every granule of the reservation has a bit
+ * in mark_bits (so a page's marks are BITMAP_WORDS consecutive words), which the marker
+ * sets and sweep consumes a word at a time. Large objects keep a flag in their
+ * descriptor instead. Between cycles the whole committed part is cleared with a memset.
+ */
+static uint64_t *mark_bits;
+
+/*
+ * Objects that have been marked but whose contents haven't been scanned yet ("grey")
+ * wait on a mark deque, so marking never recurses. Marking runs on num_threads workers,
+ * each with its own deque: the owner pushes and pops at the tail, and a worker that runs
+ * dry steals the oldest half of someone else's from the head. Deques live in their own
+ * mappings and double as needed up to MARK_STACK_MAX entries; past that, pushes are
+ * dropped and mark_stack_overflow tells mark() to recover by rescanning the heap.
+ */
+#define MARK_STACK_INITIAL 4096
+#define MARK_STACK_MAX (1UL << 22)
+#define STEAL_BATCH 256
+#define ROOT_CHUNK_SIZE (64 * 1024) /* root scanning is handed out in pieces this big */
+
+typedef struct mark_entry {
+    uintptr_t *start, *end;
+} mark_entry_t;
+
+/* A typed object goes on the mark stack with the low bit of start set, see scan_entry. */
+#define TYPED_ENTRY 1
+
+typedef struct gc_worker {
+    pthread_spinlock_t lock;    /* taken by the owner and by thieves */
+    mark_entry_t *deque;        /* ring buffer, size is a power of two */
+    size_t size, head, tail;    /* entries live in [head, tail), both only ever grow */
+    int id;
+    unsigned long job;          /* last job its helper thread picked up */
+
+    /* What this worker's share of sweep found, merged into the globals afterwards. */
+    struct page_info *empty_pages;
+    struct page_info *class_pages[NUM_SLAB_LISTS];
+    struct page_info *pending[NUM_SLAB_LISTS];
+    size_t freed;
+} gc_worker_t;
+
+static gc_worker_t *workers;
+static int num_workers;
+static int workers_size;        /* entries allocated, which the pool's helpers index */
+static __thread gc_worker_t *my_worker;
+static int mark_stack_overflow;
+static int idle_workers;
+
+/*
+ * Sweep hands out the arena a chunk at a time. Dead header_t blocks are kept per chunk
+ * rather than per worker so they can be merged back in address order.
+ */
+#define CHUNK_PAGES (ARENA_CHUNK_SIZE >> HEAP_PAGE_SHIFT)
+
+static header_t **dead_blocks;  /* one list per arena chunk */
+static size_t num_sweep_chunks, next_sweep_chunk;
+
+static mark_entry_t *root_chunks;
+static size_t num_root_chunks, root_chunks_size, next_root_chunk;
+
+#define GRANULE_INDEX(p) (((uintptr_t) (p) - (uintptr_t) heap_lo) >> GRANULE_SHIFT)
+#define IS_MARKED(p) BIT_TEST(mark_bits, GRANULE_INDEX(p))
+
+/*
+ * Set the mark bit for p, returning whether it was already set. Workers race on the same
+ * words, so this is an atomic or; the plain load first saves it for the common case of
+ * finding the object already marked.
+ */
+static inline int test_and_set_mark(void *p) {
+    size_t g = GRANULE_INDEX(p);
+    uint64_t bit = 1ULL << (g & 63);
+
+    if (mark_bits[g >> 6] & bit)
+        return 1;
+    return (__atomic_fetch_or(&mark_bits[g >> 6], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+#define IN_HEAP(v) ((uintptr_t) (v) - (uintptr_t) heap_lo < (uintptr_t) (heap_frontier - heap_lo))
+
+static page_info_t *empty_pages;                  /* PAGE_FREE pages ready for any class */
+static page_info_t *class_pages[NUM_SLAB_LISTS]; /* slab pages with free slots left */
+
+/*
+ * With lazy sweeping on, collection only sweeps the header_t blocks; slab pages are left
+ * marked on sweep_pending and the allocator sweeps them a page at a time when it runs
+ * out of room in that class. Whatever is still pending gets swept before the next mark.
+ */
+static int lazy_sweep = 0;
+static int collect_mode = MUNCH_COLLECT_STOP;
+
+/*
+ * Concurrent collection: a background thread marks while the mutator runs, and whatever
+ * the mutator wrote in the meantime is rescanned in a short remark before the sweep.
+ * While gc_marking is set, new objects are allocated already marked.
+ */
+enum { CYCLE_IDLE, CYCLE_MARKING, CYCLE_MARKED };
+static int concurrent_state = CYCLE_IDLE;
+static int gc_marking = 0;
+
+static void finish_concurrent_cycle(void);
+
+/*
+ * Incremental collection (munch_collect_step) marks and then sweeps a bounded amount at
+ * a time. While it sweeps, pages in [sweep_cursor, sweep_end) haven't been swept yet, so
+ * anything allocated there has to be marked or the sweep would take it back.
+ */
+enum { STEP_IDLE, STEP_MARK, STEP_SWEEP };
+static int step_state = STEP_IDLE;
+static size_t sweep_cursor, sweep_end;
+
+static int collect_step(uint64_t deadline);
+
+/*
+ * Whether an object allocated at p right now has to be born marked: always while a
+ * concurrent or incremental mark is running, and on pages an incremental sweep has yet
+ * to reach. Called with heap_lock held.
+ */
+static inline int alloc_black(void *p) {
+    size_t i = PAGE_INDEX(p);
+
+    return gc_marking || (i >= sweep_cursor && i < sweep_end);
+}
+
+/* The allocator finishes a cycle whose mark is done the next time it takes heap_lock. */
+#define MAYBE_FINISH_CYCLE() \
+    do { \
+        if (__atomic_load_n(&concurrent_state, __ATOMIC_ACQUIRE) == CYCLE_MARKED) \
+            finish_concurrent_cycle(); \
+    } while (0)
+static page_info_t *sweep_pending[NUM_SLAB_LISTS];
+
+static void lazy_sweep_page(page_info_t *page);
+static void lazy_sweep_class(int c);
+
+/*
+ * Large objects (large_threshold bytes and up) bypass both of the above. Each gets its own
+ * page aligned mapping and an out-of-line descriptor on the large_objs list, and sweep
+ * gives a dead one back to the kernel with a single munmap. That keeps big blocks from
+ * splitting and fragmenting the general free list.
+ */
+#define DEFAULT_LARGE_THRESHOLD (64 * 1024)
+
+typedef struct large_obj {
+    struct large_obj *next, *prev;
+    char *addr;                 /* start of the object and of its mapping */
+    size_t size;                /* bytes requested */
+    size_t map_size;            /* bytes mapped, rounded up to whole pages */
+    unsigned char *cards;       /* one per MUNCH_CARD_SHIFT bytes, see MUNCH_WRITE */
+    int marked;
+    int noscan;                 /* from munch_alloc_atomic */
+    int typed;                  /* from munch_alloc_typed */
+} large_obj_t;
+
+static large_obj_t *large_objs;
+static size_t large_threshold = DEFAULT_LARGE_THRESHOLD;
+
+/*
+ * Generational mode. Nothing moves, so the generations are told apart by their mark
+ * bits: after a generational collection the survivors keep their marks ("sticky" marks)
+ * and count as old, and anything allocated since is young. A minor collection only
+ * traces young objects, from the roots and from the cards MUNCH_WRITE dirtied in old
+ * ones, and only sweeps the nursery: the pages young objects were allocated in since
+ * the last collection, plus the large objects in front of old_large on large_objs. The
+ * survivors are promoted where they stand.
+ */
+#define CARD_SIZE (1UL << MUNCH_CARD_SHIFT)
+
+static int generational = 0;
+static int sticky_marks = 0;     /* mark bits hold the old generation, not a clean slate */
+static int keep_marks = 0;       /* tells sweep to leave the survivors' marks alone */
+static page_info_t *nursery;
+static large_obj_t *old_large;   /* first large object that survived a collection */
+static size_t live_after_major;  /* bytes in use after the last full collection */
+
+unsigned char *munch_cards;
+char *munch_cards_lo MUNCH_PRIVATE, *munch_cards_hi MUNCH_PRIVATE;
+
+static void clear_sticky_marks(void);
+
+/*
+ * Large objects live outside the arena, so they are found through a two-level page map
+ * keyed by address: the top level covers bits 47..30 and each leaf, allocated on demand,
+ * maps the 4KB pages of one 1GB region to the large object occupying them.
+ */
+#define MAP_BITS 18
+#define MAP_MASK ((1UL << MAP_BITS) - 1)
+
+static large_obj_t ***large_map;
+
+/*
+ * Every address mark_pointer could accept or blacklist lies in [scan_lo, scan_hi): the
+ * arena up to black_hi and every large object mapping. The bounds only ever widen (under heap_lock), so
+ * a marker that read them a little early just misses objects allocated since, which are
+ * allocated marked while a cycle is running anyway.
+ */
+static uintptr_t scan_lo MUNCH_PRIVATE, scan_hi MUNCH_PRIVATE;
+
+static void widen_scan_bounds(void *lo, void *hi) {
+    if (scan_hi == 0 || (uintptr_t) lo < scan_lo)
+        __atomic_store_n(&scan_lo, (uintptr_t) lo, __ATOMIC_RELAXED);
+    if ((uintptr_t) hi > scan_hi)
+        __atomic_store_n(&scan_hi, (uintptr_t) hi, __ATOMIC_RELAXED);
+}
+
+#define BIT_SET(bits, g) ((bits)[(g) >> 6] |= 1ULL << ((g) & 63))
+#define BIT_CLEAR(bits, g) ((bits)[(g) >> 6] &= ~(1ULL << ((g) & 63)))
+#define BIT_TEST(bits, g) (((bits)[(g) >> 6] >> ((g) & 63)) & 1)
+
+/* Whether the slab object or header_t block at p holds no pointers and needn't be scanned. */
+#define NOSCAN(p) BIT_TEST(page_table[PAGE_INDEX(p)].noscan_bits, ((uintptr_t) (p) & (HEAP_PAGE_SIZE - 1)) >> GRANULE_SHIFT)
+#define TYPED(p) BIT_TEST(page_table[PAGE_INDEX(p)].typed_bits, ((uintptr_t) (p) & (HEAP_PAGE_SIZE - 1)) >> GRANULE_SHIFT)
+
+/*
+ * Precise layouts registered with munch_register_type. An object from munch_alloc_typed
+ * carries its type id in its last word, and the marker only looks at the words its
+ * layout says can hold pointers, repeating the layout over the rest of the object. Ids
+ * index a fixed table so markers can read it while someone registers a new type.
+ */
+#define MAX_TYPES 4096
+#define TYPE_NOSCAN (-1)    /* munch_alloc_atomic */
+#define TYPE_CONSERVATIVE 0 /* munch_alloc */
+
+typedef struct type_layout {
+    uint64_t *bits;
+    size_t nwords;
+} type_layout_t;
+
+static type_layout_t types[MAX_TYPES];
+static int num_types = 1;   /* 0 is TYPE_CONSERVATIVE */
+
+/*
+ * Record what sort of object was just allocated at granule g of a page. Called before its
+ * alloc bit is set, so a marker never sees a stale kind on a live object.
+ */
+static inline void set_object_type(page_info_t *page, size_t g, int type) {
+    if (type == TYPE_NOSCAN)
+        BIT_SET(page->noscan_bits, g);
+    else
+        BIT_CLEAR(page->noscan_bits, g);
+    if (type > 0)
+        BIT_SET(page->typed_bits, g);
+    else
+        BIT_CLEAR(page->typed_bits, g);
+}
+
+/*
+ * Blacklisting. A value that points into a free page, or one of the reservation that
+ * hasn't been handed out yet, can't be a real pointer, but the moment an object went
+ * there it would keep that object, and everything the object points to, alive for as
+ * long as the value stays around. The marker records such pages in new_black_pages, and
+ * each full collection makes that the black_pages the allocator goes by and starts the
+ * next one empty, so a page only stays blacklisted while something still seems to point
+ * at it. Only values up to black_hi, a window past the frontier as big as the heap
+ * so far, are looked at, so the scan filter doesn't let the whole reservation through.
+ *
+ * arena_alloc_pages steps over blacklisted pages and leaves them on black_holes. Atomic
+ * slab pages can go there, or anywhere blacklisted, since an atomic object can't keep
+ * anything else alive; the rest wait until aging clears them. Both bitmaps are shared
+ * mappings, so what a fork collection's child finds makes it back too.
+ */
+#define BLACKLIST_WINDOW (64UL * 1024 * 1024)
+
+static uint64_t *black_pages, *new_black_pages;
+static char *black_hi MUNCH_PRIVATE;
+static page_info_t *black_holes;
+
+#define BLACKLISTED(i) (BIT_TEST(black_pages, i) || BIT_TEST(new_black_pages, i))
+
+static inline void blacklist_page(size_t i) {
+    if (!BIT_TEST(new_black_pages, i))
+        __atomic_fetch_or(&new_black_pages[i >> 6], 1ULL << (i & 63), __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether a false pointer has been seen into any of the npages pages at p that could keep
+ * an object starting at p alive under the interior pointer policy.
+ */
+static int pages_blacklisted(char *p, size_t npages) {
+    size_t first = PAGE_INDEX(p);
+
+    if (interior_mode == MUNCH_INTERIOR_NONE)
+        npages = 1;
+    else if (interior_mode == MUNCH_INTERIOR_PREFIX &&
+             npages > ((interior_prefix + sizeof(header_t)) >> HEAP_PAGE_SHIFT) + 1)
+        npages = ((interior_prefix + sizeof(header_t)) >> HEAP_PAGE_SHIFT) + 1;
+    for (size_t i = first; i < first + npages; i++) {
+        if (BLACKLISTED(i))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Thread-local allocation buffers. For every size class a thread owns one slab page and
+ * pops or bumps objects out of it without taking heap_lock. When the page runs out the
+ * thread swaps it for another one under the lock. Buffers are retired (their pages
+ * handed back to the shared lists) before every collection and when their thread exits.
+ */
+typedef struct tlab_class {
+    page_info_t *page;
+    void *free;
+    char *bump, *limit;
+    int black;                  /* objects here must be allocated marked, see alloc_black */
+} tlab_class_t;
+
+typedef struct tlab {
+    tlab_class_t cls[NUM_SLAB_LISTS];
+    size_t allocated;           /* bytes, folded into used_memory on retire */
+    struct tlab *next;
+} tlab_t;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; /* guards everything shared */
+static tlab_t *tlabs;           /* every live buffer, so the collector can retire them */
+static pthread_key_t tlab_key;  /* runs tlab_exit() when a thread goes away */
+static __thread tlab_t *my_tlab;
 
 static int num_mmaps = 0;
 
 static size_t used_memory = 0;
 static size_t total_memory = 8ULL * 1024 * 1024 * 1024;  // 8GB
 static int num_threads = 0; // set at runtime 
-static pthread_t *threads = NULL;
-
-static Barrier *barrier;
 
 
 int optimal_num_threads() {
@@ -54,6 +461,24 @@ int get_num_threads(void) {
     return num_threads;
 }
 
+static void setup_mark_workers(void);
+
+/*
+ * Use n threads (including the one collecting) for parallel marking. A concurrent mark
+ * that's running holds on to the workers, so it's finished first.
+ */
+void munch_set_gc_threads(int n) {
+    if (n < 1)
+        n = 1;
+    pthread_mutex_lock(&heap_lock);
+    if (concurrent_state != CYCLE_IDLE)
+        finish_concurrent_cycle();
+    num_threads = n;
+    if (workers != NULL) /* otherwise muncher_init will do it */
+        setup_mark_workers();
+    pthread_mutex_unlock(&heap_lock);
+}
+
 
 typedef struct RegisterSnapshot {
     uintptr_t rax, rbx, rcx, rdx, rsi, rdi;
@@ -61,13 +486,11 @@ typedef struct RegisterSnapshot {
 } RegisterSnapshot;
 
 
-static RegisterSnapshot *regs = NULL;
-
 // saves the state of the general-purpose regs for marking later.
 
 // NOTE: we don't capture rbp since it seems to cause some bugs, and also because
 // you would just never find a reference to a HEAP ADDRESS in the stack base pointer... tsk tsk
-void capture_registers() {
+void capture_registers(RegisterSnapshot *regs) {
     asm volatile(
     "mov %%rax, %0\n"
     "mov %%rbx, %1\n"
@@ -94,6 +517,18 @@ void capture_registers() {
 
 }
 
+/*
+ * The low end of the current stack, for scanning it. Not the frame address: a function
+ * saves its caller's callee-saved registers below that and may well have reused the
+ * registers themselves by the time it captures them.
+ */
+static inline uintptr_t *stack_pointer(void) {
+    uintptr_t *sp;
+
+    asm volatile("mov %%rsp, %0" : "=r"(sp));
+    return sp;
+}
+
 
 
 
@@ -101,103 +536,222 @@ void capture_registers() {
 
 
 
+static void mark_pointer(uintptr_t v);
+
 // cycle through allocated blocks to see if there are any references in our register snapshot.
-void mark_register_roots() {
+void mark_register_roots(RegisterSnapshot *regs) {
     uintptr_t* reg_ptr = (uintptr_t*)regs;
     size_t num_registers = sizeof(RegisterSnapshot) / sizeof(uintptr_t);
 
     for (size_t i = 0; i < num_registers; i++) {
         uintptr_t reg_value = reg_ptr[i];  // Dereference to get the register value
+        mark_pointer(reg_value);
+    }
+}
 
-        header_t* bp = usedp;
-        do {
-            if ((uintptr_t)(bp + 1) <= reg_value && 
-                (uintptr_t)(bp + 1) + bp->size > reg_value) {
-                bp->next = (header_t*)((uintptr_t)bp->next | 1);  // Mark the block as reached
-                break;
-            }
-        } while ((bp = UNTAG(bp->next)) != usedp);
+/*
+ * Every thread that can hold pointers into the heap is registered, so the collector can
+ * find its stack. To collect, the collector stops the others with SIG_SUSPEND: each one
+ * saves its registers and publishes the top of its stack from the signal handler, posts
+ * suspend_ack and waits for SIG_RESTART. A thread in the middle of the lock-free part of
+ * munch_alloc (in_alloc) puts the stop off until it's out of it, so a stopped thread never
+ * leaves its buffer half updated. Nothing that runs while the world is stopped may call
+ * malloc or stdio, since a stopped thread could be holding their locks.
+ */
+#define SIG_SUSPEND SIGPWR
+#define SIG_RESTART SIGXCPU
+
+typedef struct mutator {
+    pthread_t thread;
+    char *stack_hi;             /* the stack grows down from here */
+    char *stack_top;            /* published by the thread when it stops */
+    RegisterSnapshot regs;      /* likewise */
+    int stopped;                /* stopped by the current stop_world */
+    struct mutator *next;
+} mutator_t;
+
+static mutator_t *mutators;     /* guarded by heap_lock */
+static pthread_key_t mutator_key; /* unregisters a thread when it exits */
+static __thread mutator_t *my_thread;
+static __thread volatile sig_atomic_t in_alloc, stop_deferred;
+static int world_stopped;
+static sem_t suspend_ack;       /* posted once by each thread as it stops, and as it restarts */
+
+/*
+ * Publish our stack and registers and wait until the collector is done. Runs in the
+ * suspend handler, or straight from munch_alloc if the stop was put off.
+ */
+static void stop_self(void) {
+    mutator_t *m = my_thread;
+    sigset_t mask, old;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIG_RESTART);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    stop_deferred = 0;
+    capture_registers(&m->regs);
+    m->stack_top = (char *) stack_pointer();
+    sem_post(&suspend_ack);
+
+    mask = old;
+    sigdelset(&mask, SIG_RESTART);
+    while (__atomic_load_n(&world_stopped, __ATOMIC_ACQUIRE))
+        sigsuspend(&mask);
+    sem_post(&suspend_ack);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void suspend_handler(int sig) {
+    int saved_errno = errno;
+
+    (void) sig;
+    if (in_alloc)
+        stop_deferred = 1;
+    else if (my_thread != NULL)
+        stop_self();
+    errno = saved_errno;
+}
+
+static void restart_handler(int sig) {
+    (void) sig; /* only here to interrupt sigsuspend */
+}
+
+static void sem_wait_n(sem_t *sem, int n) {
+    while (n > 0) {
+        if (sem_wait(sem) == 0)
+            n--;
     }
 }
 
-// this should disable write permissions on EVERY page, so we need to be smart about how we do this
-int prepare_cow_snapshot() {
-    size_t pagesize = getpagesize();
-    header_t *temp = freep;
-    /*
-    while (temp != NULL) {
-	printf("HERE %d\n", temp->mmap_addr);
-	fflush(stdout);
-	size_t aligned_size = (sizeof(header_t) + temp->original_size + pagesize - 1) & ~(pagesize - 1);
-	if (mprotect(temp->mmap_addr, aligned_size, PROT_READ) == -1) {
-	    perror("mprotect");
-	    return -1;
-	}
-	temp = temp->next;
+static void forget_thread(mutator_t *m) {
+    mutator_t **mp;
+
+    pthread_mutex_lock(&heap_lock);
+    for (mp = &mutators; *mp != m; mp = &(*mp)->next)
+        ;
+    *mp = m->next;
+    pthread_mutex_unlock(&heap_lock);
+    my_thread = NULL;
+    free(m);
+}
+
+static void tlab_exit(void *arg);
+static void tlab_retire(tlab_t *t);
+
+/*
+ * Register the calling thread, so that its stack and registers are scanned for roots.
+ * Threads that allocate are registered the first time they do; the ones that only hold
+ * pointers into the heap have to call this themselves.
+ */
+void munch_register_thread(void) {
+    pthread_attr_t attr;
+    mutator_t *m;
+    void *addr;
+    size_t size;
+
+    if (my_thread != NULL)
+        return;
+    if ((m = calloc(1, sizeof(mutator_t))) == NULL)
+        return;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        free(m);
+        return;
     }
-    */
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    m->thread = pthread_self();
+    m->stack_hi = (char *) addr + size;
+
+    my_thread = m;
+    pthread_setspecific(mutator_key, m);
+    pthread_mutex_lock(&heap_lock);
+    m->next = mutators;
+    mutators = m;
+    pthread_mutex_unlock(&heap_lock);
+}
 
-    header_t *p = usedp;
-    if (p != NULL) { // Ensure there's at least one element in the list
-	do {
-	    printf("top\n");
-	    fflush(stdout);
-	    header_t *next_page = p;
-	    while((p->mmap_addr < next_page) && (next_page <= (p->mmap_addr+pagesize)) && (next_page != usedp)) {
-		next_page = next_page->next;	
-	    }
-
-	    printf("HERE %d, %d\n", p->mmap_addr, p);
-	    fflush(stdout);
-	    // ignore all zero address blocks
-	    if(p->mmap_addr == 0) {
-		p = p->next;
-		printf("continuing \n");
-		fflush(stdout);
-		continue;
-	    }
-            size_t aligned_size = (sizeof(header_t) + p->original_size + pagesize - 1) & ~(pagesize - 1);
-	    uintptr_t addr_to_protect = p->mmap_addr;
-	    p = next_page; // increment the page BEFORE we make it readonly...
-	    if (mprotect(p->mmap_addr, aligned_size, PROT_READ) == -1) {
-		perror("mprotect");
-		return -1;
-	    }
-	    printf("success\n");
-	    fflush(stdout);
-	    //return 0;
-	    //p = p->next;
-	    //p = next_page;
-	} while (p != usedp);
+/*
+ * Stop scanning the calling thread, which must not hold on to anything in the heap from
+ * now on. Allocating again registers it again.
+ */
+void munch_unregister_thread(void) {
+    if (my_thread == NULL)
+        return;
+    if (my_tlab != NULL) {
+        pthread_setspecific(tlab_key, NULL);
+        tlab_exit(my_tlab);
+        my_tlab = NULL;
     }
-    return 0;
+    pthread_setspecific(mutator_key, NULL);
+    forget_thread(my_thread);
+}
+
+static void mutator_exit(void *arg) {
+    forget_thread(arg);
 }
 
+static void update_data_segments(void);
 
-// basically just enable write permissions for every single block to resume normal use
-int restore_heap_write() {
-    header_t *temp = freep;
-    while (temp != NULL) { // TODO does 'size' actually have bytes, or is it in 'units'?
-	if (mprotect(temp, sizeof(header_t) + temp->size, PROT_READ | PROT_WRITE) == -1) {
-	    perror("mprotect");
-	    return -1;
-	}
-	temp = temp->next;
+/*
+ * Stop every other registered thread at a safepoint, then retire every buffer. Called
+ * with heap_lock held, which keeps anyone from registering meanwhile.
+ */
+static void stop_world(void) {
+    int n = 0;
+
+    update_data_segments();
+    __atomic_store_n(&world_stopped, 1, __ATOMIC_RELEASE);
+    for (mutator_t *m = mutators; m != NULL; m = m->next) {
+        m->stopped = m != my_thread && pthread_kill(m->thread, SIG_SUSPEND) == 0;
+        n += m->stopped;
     }
+    sem_wait_n(&suspend_ack, n);
+
+    for (tlab_t *t = tlabs; t != NULL; t = t->next)
+        tlab_retire(t);
+}
+
+/*
+ * Let them go again, and wait until they're all out of the handler so the next stop
+ * doesn't find one still in it.
+ */
+static void start_world(void) {
+    int n = 0;
 
-    header_t *p = usedp;
-    if (p != NULL) { // Ensure there's at least one element in the list
-	do {
-	    if (mprotect(p, sizeof(header_t) + p->size, PROT_READ | PROT_WRITE) == -1) {
-		perror("mprotect");
-		return -1;
-	    }
-	    p = p->next;
-	} while (p != usedp);
+    __atomic_store_n(&world_stopped, 0, __ATOMIC_RELEASE);
+    for (mutator_t *m = mutators; m != NULL; m = m->next) {
+        if (m->stopped && pthread_kill(m->thread, SIG_RESTART) == 0)
+            n++;
     }
-    return 0;
+    sem_wait_n(&suspend_ack, n);
 }
 
+static void add_root_range(uintptr_t *start, uintptr_t *end);
+static void scan_region(uintptr_t *sp, uintptr_t *end);
+
+/*
+ * Roots in the registered threads: our own registers and stack as they are now, and
+ * whatever the stopped threads published. Our own stack is scanned on the spot, since
+ * the collector's frames reuse it straight after and would leave their locals, heap_lo
+ * among them, in a queued range. The other stacks go to fn, which either queues them
+ * (when the world stays stopped for the mark) or scans them on the spot too (when it's
+ * about to start again and a thread could exit with its stack still queued).
+ */
+static void add_thread_roots(void (*fn)(uintptr_t *, uintptr_t *)) {
+    RegisterSnapshot regs;
+
+    capture_registers(&regs);
+    mark_register_roots(&regs);
+    if (my_thread != NULL)
+        scan_region(stack_pointer(), (uintptr_t *) my_thread->stack_hi);
+
+    for (mutator_t *m = mutators; m != NULL; m = m->next) {
+        if (m == my_thread || !m->stopped)
+            continue;
+        mark_register_roots(&m->regs);
+        fn((uintptr_t *) m->stack_top, (uintptr_t *) m->stack_hi);
+    }
+}
 
 /*
  * Scan the free list and look for a place to put the block. Basically, we're 
@@ -235,317 +789,2880 @@ static void add_to_free_list(header_t *bp) {
 }
 
 /*
- * Request more memory from the kernel.
+ * The side tables are reserved for the whole heap like the heap itself, and the parts
+ * describing [from, to) get committed along with it.
  */
-static header_t* morecore(size_t num_units) {
-    size_t pagesize = getpagesize();
-    size_t required_size = num_units * sizeof(header_t);
-    // Align required size to the next page boundary
-    size_t total_size = (required_size + pagesize - 1) & ~(pagesize - 1);
+static int commit_side_table(void *table, size_t entry_size, size_t shift, char *from, char *to) {
+    uintptr_t start = (uintptr_t) table + (((uintptr_t) (from - heap_lo) >> shift) * entry_size);
+    uintptr_t stop = (uintptr_t) table + (((uintptr_t) (to - heap_lo) >> shift) * entry_size);
 
-    void *vp;
-    if (posix_memalign(&vp, pagesize, total_size) != 0) {
-	printf("misalignment\n");
-	fflush(stdout);
+    start &= ~(HEAP_PAGE_SIZE - 1);
+    stop = (stop + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+    return mprotect((void *) start, stop - start, PROT_READ | PROT_WRITE);
+}
+
+/*
+ * Hand out the npages pages at p, which is at or above the frontier, committing
+ * more of the reservation when we run past what's already committed.
+ */
+static char *arena_take_pages(char *p, size_t npages) {
+    size_t size = npages << HEAP_PAGE_SHIFT;
+
+    if (size > (size_t) (heap_hi - p))
         return NULL;
+    if (p + size > heap_committed) {
+        size_t grow = (p + size - heap_committed + ARENA_CHUNK_SIZE - 1) & ~(ARENA_CHUNK_SIZE - 1);
+        if (grow > (size_t) (heap_hi - heap_committed))
+            grow = heap_hi - heap_committed;
+        if (mprotect(heap_committed, grow, PROT_READ | PROT_WRITE) == -1 ||
+            commit_side_table(page_table, sizeof(page_info_t), HEAP_PAGE_SHIFT,
+                              heap_committed, heap_committed + grow) == -1 ||
+            commit_side_table(mark_bits, 1, GRANULE_SHIFT + 3,
+                              heap_committed, heap_committed + grow) == -1 ||
+            commit_side_table(munch_cards, 1, MUNCH_CARD_SHIFT,
+                              heap_committed, heap_committed + grow) == -1) {
+            perror("mprotect");
+            return NULL;
+        }
+        num_mmaps += 1; // increment this for debugging purposes
+        heap_committed += grow;
     }
-    if (mmap(vp, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == MAP_FAILED) {
-	printf("map failed\n");
-	fflush(stdout);
-        return NULL;
+    for (char *q = heap_frontier; q < p + size; q += HEAP_PAGE_SIZE)
+        page_table[PAGE_INDEX(q)].base = q;
+    heap_frontier = p + size;
+
+    size_t window = heap_frontier - heap_lo > BLACKLIST_WINDOW ? heap_frontier - heap_lo : BLACKLIST_WINDOW;
+    if (window > (size_t) (heap_hi - heap_frontier))
+        window = heap_hi - heap_frontier;
+    if (heap_frontier + window > black_hi) {
+        __atomic_store_n(&black_hi, heap_frontier + window, __ATOMIC_RELAXED);
+        widen_scan_bounds(heap_lo, black_hi);
     }
-    num_mmaps += 1; // increment this for debugging purposes
-    header_t *up = (header_t*) vp;
-    up->size = total_size / sizeof(header_t); // Convert total size back to units
-    up->mmap_addr = vp;
-    printf("mmap addr original: %d\n", up->mmap_addr);
-    fflush(stdout);
-    up->original_size = total_size / sizeof(header_t);
-    add_to_free_list(up);
-    return freep;
+    return p;
 }
 
 /*
- * Scan a region of memory and mark any items in the used list appropriately.
- * Both arguments should be word aligned.
+ * Hand out npages fresh pages from the top of the arena, stepping over pages
+ * that stray pointers have been seen into. The pages stepped over are free: the
+ * blacklisted ones go on black_holes, the rest on empty_pages.
  */
-static void scan_region(uintptr_t *sp, uintptr_t *end) {
-    header_t *bp;
+static char *arena_alloc_pages(size_t npages) {
+    char *start = heap_frontier, *p = start;
 
-    for (; sp < end; sp++) {
-        uintptr_t v = *sp;
-        bp = usedp;
-        do {
-            if (bp + 1 <= v &&
-                bp + 1 + bp->size > v) {
-                    bp->next = ((uintptr_t) bp->next) | 1;
-		    //printf("marking block. size: %d\n", bp->size);
-                    break;
-            }
-        } while ((bp = UNTAG(bp->next)) != usedp);
+    while ((npages << HEAP_PAGE_SHIFT) <= (size_t) (heap_hi - p) && pages_blacklisted(p, npages))
+        p += HEAP_PAGE_SIZE;
+    if (arena_take_pages(p, npages) == NULL)
+        return NULL;
+    for (char *q = start; q < p; q += HEAP_PAGE_SIZE) {
+        page_info_t *page = &page_table[PAGE_INDEX(q)];
+        if ((page->black = BLACKLISTED(PAGE_INDEX(q)))) {
+            page->next = black_holes;
+            black_holes = page;
+        } else {
+            page->next = empty_pages;
+            empty_pages = page;
+        }
     }
+    return p;
 }
 
-void* munch_alloc(size_t size) {
-    // check to see if we need to trigger garbage collection
-    // TODO we will probably want to move this somewhere nicer eventually
-    //float usage = (float)used_memory / total_memory;
-    //if(usage > 0.75) {
-    /*
-    if(usage > 0.0001) {
-	printf("going to MUNCH!... using %d bytes \n", used_memory);
-	muncher_collect();
-    }
-    */
-    
-
-    size_t num_units;
-    header_t *p, *prevp;
+/*
+ * Give npages new pages at vp to the general free list.
+ */
+static void add_block_pages(char *vp, size_t npages) {
+    for (size_t i = 0; i < npages; i++)
+        page_table[PAGE_INDEX(vp) + i].kind = PAGE_BLOCK;
 
-    num_units = (size + sizeof(header_t) - 1) / sizeof(header_t) + 1;  
-    prevp = freep;
+    header_t *up = (header_t*) vp;
+    up->size = (npages << HEAP_PAGE_SHIFT) / sizeof(header_t); // Convert total size back to units
+    add_to_free_list(up);
+}
 
-    for (p = prevp->next;; prevp = p, p = p->next) {
-        if (p->size >= num_units) { /* Big enough. */
-            if (p->size == num_units) {/* Exact size. */
-		printf("this1\n");
-		fflush(stdout);
-                prevp->next = p->next;
-	    }
-            else {
-		printf("this2 %d\n", p->mmap_addr);
-		printf("p val: %d\n", p);
-		fflush(stdout);
-		uintptr_t mmap_addr_copy = p->mmap_addr;
-		size_t original_size_copy = p->original_size;
-                p->size -= num_units;
-                p += p->size;
-                p->size = num_units;
-		//p->mmap_addr = prevp->mmap_addr;
-		//p->original_size = prevp->original_size;
-		p->mmap_addr = mmap_addr_copy;
-		p->original_size = original_size_copy;
-		printf("this2 AGAIN %d\n", p->mmap_addr);
-		printf("p val: %d\n", p);
-		fflush(stdout);
-            }
+/*
+ * Request more memory for the general free list.
+ */
+static header_t* morecore(size_t num_units) {
+    size_t required_size = num_units * sizeof(header_t);
+    size_t npages;
+    char *vp;
 
-            //freep = prevp;
+    if (required_size < MIN_ALLOC_SIZE)
+        required_size = MIN_ALLOC_SIZE;
+    npages = (required_size + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+    if ((vp = arena_alloc_pages(npages)) == NULL)
+        return NULL;
+    add_block_pages(vp, npages);
+    return freep;
+}
 
-            /* Add to p to the used list. */
-            if (usedp == NULL) {
-                usedp = p->next = p;
-		usedp->mmap_addr = p->mmap_addr;
-		usedp->original_size = p->original_size;
-		printf("this3... %d\n", usedp->mmap_addr);
-		fflush(stdout);
-	    }
-            else {
-		printf("this4\n");
-		fflush(stdout);
-                p->next = usedp->next;
-                usedp->next = p;
-		p->mmap_addr = usedp->mmap_addr; // Set the mmap_addr for the new used block
-		p->original_size = usedp->original_size; // Set the original_size for the new used block
+/*
+ * Get an empty page for a slab, reusing one that sweep emptied if there is one. An
+ * atomic page takes a blacklisted one first, and doesn't step over any at the frontier.
+ */
+static page_info_t *get_empty_page(int atomic) {
+    page_info_t *page;
+    char *p;
+
+    if (atomic && (page = black_holes) != NULL) {
+        black_holes = page->next;
+        page->fresh = 0;
+        return page;
+    }
+    for (;;) {
+        /* Pages still waiting on a lazy sweep may well be empty; find out before growing. */
+        for (int c = 0; empty_pages == NULL && c < NUM_SLAB_LISTS; c++) {
+            while (empty_pages == NULL && (page = sweep_pending[c]) != NULL) {
+                sweep_pending[c] = page->next;
+                lazy_sweep_page(page);
             }
-	    used_memory += size; // We are now using 'size' extra bytes of memory in total
-            return (void *) (p + 1);
         }
-        if (p == freep) { /* Not enough memory. */
-            p = morecore(num_units);
-	    printf("this5 %d, %d, %d\n", p->mmap_addr, p->next->mmap_addr, freep);
-	    printf("p val: %d, p->next: %d\n", p, p->next);
-	    fflush(stdout);
-            if (p == NULL) /* Request for more memory failed. */
-                return NULL;
+        if ((page = empty_pages) == NULL)
+            break;
+        empty_pages = page->next;
+        if (page->black && !atomic) { /* an atomic page emptied; wait for aging */
+            page->next = black_holes;
+            black_holes = page;
+            continue;
         }
+        page->fresh = 0;
+        return page;
     }
+    if ((p = atomic ? arena_take_pages(heap_frontier, 1) : arena_alloc_pages(1)) == NULL)
+        return NULL;
+    page = &page_table[PAGE_INDEX(p)];
+    page->black = atomic && BLACKLISTED(PAGE_INDEX(p));
+    page->fresh = 1;
+    return page;
 }
 
+/*
+ * Find the used header_t block that contains v, given v's PAGE_BLOCK page. A block's
+ * header has its alloc bit set, so we look for the closest one at or below v in this
+ * page; failing that, the block (if any) started on an earlier page and is the one
+ * recorded in page->block when it was allocated. A pointer to the header counts too:
+ * munch_alloc holds nothing else between unlocking and returning, and can be stopped
+ * there.
+ */
+static header_t *find_block(page_info_t *page, uintptr_t v) {
+    size_t g = (v - (uintptr_t) page->base) >> GRANULE_SHIFT;
+    int w = g >> 6;
+    uint64_t bits = page->alloc_bits[w] & (~0ULL >> (63 - (g & 63)));
+    header_t *bp;
 
-void muncher_cleanup(void) {
-    printf("number of allocs: %d\n", num_mmaps);
-    fflush(stdout);
-    free(regs);
+    while (bits == 0 && w > 0)
+        bits = page->alloc_bits[--w];
+    if (bits != 0)
+        bp = (header_t *) (page->base + (((size_t) w * 64 + 63 - __builtin_clzll(bits)) << GRANULE_SHIFT));
+    else {
+        page_info_t *owner;
+        if ((bp = page->block) == NULL)
+            return NULL;
+        owner = &page_table[PAGE_INDEX(bp)];
+        if (!BIT_TEST(owner->alloc_bits, ((char *) bp - owner->base) >> GRANULE_SHIFT))
+            return NULL;
+    }
+    if (v < (uintptr_t) (bp + bp->size))
+        return bp;
+    return NULL;
 }
 
-
-
-
 /*
- * Find the absolute bottom of the stack and set stuff up.
+ * Record a header_t block as allocated (or not) in the side table, so find_block can
+ * get from any address in it back to the header.
  */
-void muncher_init(void) {
-    static int initted;
-    FILE *statfp;
+static void set_block_allocated(header_t *bp, int allocated) {
+    page_info_t *page = &page_table[PAGE_INDEX(bp)];
+    size_t g = ((char *) bp - page->base) >> GRANULE_SHIFT;
+    size_t first, last;
 
-    if (initted)
+    if (!allocated) {
+        page->alloc_bits[g >> 6] &= ~(1ULL << (g & 63));
         return;
+    }
+    BIT_SET(page->alloc_bits, g);
+    first = PAGE_INDEX(bp) + 1;
+    last = PAGE_INDEX((char *) (bp + bp->size) - 1);
+    for (size_t i = first; i <= last; i++)
+        page_table[i].block = bp;
+}
 
-    initted = 1;
+static large_obj_t *large_object_of(uintptr_t v) {
+    large_obj_t **leaf;
+    large_obj_t *lo;
 
-    // initialize memory barrier
-    //barrier_init(barrier);
+    if (large_map == NULL || (v >> (HEAP_PAGE_SHIFT + 2 * MAP_BITS)) != 0)
+        return NULL;
+    if ((leaf = large_map[v >> (HEAP_PAGE_SHIFT + MAP_BITS)]) == NULL)
+        return NULL;
+    lo = leaf[(v >> HEAP_PAGE_SHIFT) & MAP_MASK];
+    if (lo == NULL || v >= (uintptr_t) lo->addr + lo->size)
+        return NULL;
+    return lo;
+}
 
-    get_num_threads();
-    // malloc all of our execution threads..
-    threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-    if (threads == NULL) { // allocation failure
-        exit(1);
+/*
+ * Point every page of a large object's mapping at it in the page map (or clear them).
+ */
+static int map_large_object(large_obj_t *lo, large_obj_t *value) {
+    for (uintptr_t a = (uintptr_t) lo->addr; a < (uintptr_t) lo->addr + lo->map_size; a += HEAP_PAGE_SIZE) {
+        large_obj_t ***top = &large_map[a >> (HEAP_PAGE_SHIFT + MAP_BITS)];
+        if (*top == NULL) {
+            void *leaf = mmap(NULL, (MAP_MASK + 1) * sizeof(large_obj_t *), PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (leaf == MAP_FAILED)
+                return 0;
+            *top = leaf;
+        }
+        (*top)[(a >> HEAP_PAGE_SHIFT) & MAP_MASK] = value;
     }
+    return 1;
+}
 
-    atexit(muncher_cleanup); // specify that we want to call 'muncher_cleanup()' right before program exit to clean up
+/*
+ * Double a worker's deque. Called with its lock held.
+ */
+static int grow_deque(gc_worker_t *w) {
+    size_t new_size = w->size ? w->size * 2 : MARK_STACK_INITIAL;
+    mark_entry_t *deque;
+    size_t n = 0;
+
+    if (new_size > MARK_STACK_MAX)
+        return 0;
+    deque = mmap(NULL, new_size * sizeof(mark_entry_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (deque == MAP_FAILED)
+        return 0;
+    for (; w->head != w->tail; w->head++)
+        deque[n++] = w->deque[w->head & (w->size - 1)];
+    if (w->deque != NULL)
+        munmap(w->deque, w->size * sizeof(mark_entry_t));
+    w->deque = deque;
+    w->size = new_size;
+    w->head = 0;
+    w->tail = n;
+    return 1;
+}
+
+static void mark_stack_push(void *start, void *end) {
+    gc_worker_t *w = my_worker;
+
+    pthread_spin_lock(&w->lock);
+    if (w->tail - w->head == w->size && !grow_deque(w))
+        __atomic_store_n(&mark_stack_overflow, 1, __ATOMIC_RELAXED);
+    else {
+        w->deque[w->tail & (w->size - 1)].start = start;
+        w->deque[w->tail & (w->size - 1)].end = end;
+        w->tail++;
+    }
+    pthread_spin_unlock(&w->lock);
+}
+
+static int mark_stack_pop(gc_worker_t *w, mark_entry_t *e) {
+    int found = 0;
+
+    pthread_spin_lock(&w->lock);
+    if (w->tail != w->head) {
+        w->tail--;
+        *e = w->deque[w->tail & (w->size - 1)];
+        found = 1;
+    }
+    pthread_spin_unlock(&w->lock);
+    return found;
+}
+
+/*
+ * The header_t block that v is the start (or the header) of, if any. Unlike find_block
+ * this is one bitmap test, with no search back for the header.
+ */
+static header_t *block_at(page_info_t *page, uintptr_t v) {
+    page_info_t *owner;
+
+    if (v & ((1UL << GRANULE_SHIFT) - 1))
+        return NULL;
+    if (BIT_TEST(page->alloc_bits, (v - (uintptr_t) page->base) >> GRANULE_SHIFT))
+        return (header_t *) v;
+    v -= sizeof(header_t);
+    if (!IN_HEAP(v))
+        return NULL;
+    owner = &page_table[PAGE_INDEX(v)]; /* the header can be at the end of the page before */
+    if (owner->kind == PAGE_BLOCK && BIT_TEST(owner->alloc_bits, (v - (uintptr_t) owner->base) >> GRANULE_SHIFT))
+        return (header_t *) v;
+    return NULL;
+}
+
+/*
+ * Conservative pointer test: if v points into an allocated object that isn't marked yet,
+ * mark it and push it for scanning. Every word we scan comes through here, so it has to stay O(1): the arena resolves v to its page
+ * with a shift, and anything outside it goes through the large object page map.
+ */
+static void mark_pointer(uintptr_t v) {
+    if (IN_HEAP(v)) {
+        page_info_t *page = &page_table[PAGE_INDEX(v)];
+        int kind = __atomic_load_n(&page->kind, __ATOMIC_ACQUIRE); /* pairs with tlab_refill */
+
+        if (kind == PAGE_SLAB && interior_mode == MUNCH_INTERIOR_NONE) {
+            /* Every slab object starts on a granule and has its first granule's bit set. */
+            size_t g = (v - (uintptr_t) page->base) >> GRANULE_SHIFT;
+            if (!(v & ((1UL << GRANULE_SHIFT) - 1)) && BIT_TEST(page->alloc_bits, g) &&
+                !test_and_set_mark((void *) v) && !BIT_TEST(page->noscan_bits, g))
+                mark_stack_push((char *) v + BIT_TEST(page->typed_bits, g), (char *) v + page->obj_size);
+        } else if (kind == PAGE_SLAB) {
+            size_t slot = (v - (uintptr_t) page->base) / page->obj_size;
+            size_t g = (slot * page->obj_size) >> GRANULE_SHIFT;
+            char *obj = page->base + (g << GRANULE_SHIFT);
+            if (slot < page->nobjs && BIT_TEST(page->alloc_bits, g) &&
+                (interior_mode == MUNCH_INTERIOR_ALL || v - (uintptr_t) obj < interior_prefix) &&
+                !test_and_set_mark(obj) && !BIT_TEST(page->noscan_bits, g))
+                mark_stack_push(obj + BIT_TEST(page->typed_bits, g), obj + page->obj_size);
+        } else if (kind == PAGE_BLOCK) {
+            header_t *bp = interior_mode == MUNCH_INTERIOR_NONE ? block_at(page, v) : find_block(page, v);
+            if (bp != NULL &&
+                (interior_mode != MUNCH_INTERIOR_PREFIX || v < (uintptr_t) (bp + 1) + interior_prefix) &&
+                !test_and_set_mark(bp) && !NOSCAN(bp))
+                mark_stack_push((char *) (bp + 1) + TYPED(bp), bp + bp->size);
+        } else
+            blacklist_page(PAGE_INDEX(v));
+        return;
+    }
+    if ((uintptr_t) v - (uintptr_t) heap_lo < (uintptr_t) (__atomic_load_n(&black_hi, __ATOMIC_RELAXED) - heap_lo)) {
+        blacklist_page(PAGE_INDEX(v));
+        return;
+    }
+
+    large_obj_t *lo = large_object_of(v);
+    if (lo != NULL && (interior_mode == MUNCH_INTERIOR_ALL ||
+                       v - (uintptr_t) lo->addr < (interior_mode == MUNCH_INTERIOR_NONE ? 1 : interior_prefix)) &&
+        !lo->marked && !__atomic_exchange_n(&lo->marked, 1, __ATOMIC_RELAXED) && !lo->noscan)
+        mark_stack_push(lo->addr + lo->typed, lo->addr + lo->size);
+}
+
+/*
+ * Choose which pointers keep an object alive, see interior_mode. With
+ * MUNCH_INTERIOR_PREFIX, pointers into its first 'bytes' bytes do. Returns 0, or -1 if
+ * mode isn't one of the MUNCH_INTERIOR_* policies, in which case the old one stays.
+ */
+int munch_set_interior_pointers(int mode, size_t bytes) {
+    if (mode != MUNCH_INTERIOR_ALL && mode != MUNCH_INTERIOR_NONE && mode != MUNCH_INTERIOR_PREFIX)
+        return -1;
+    pthread_mutex_lock(&heap_lock);
+    interior_mode = mode;
+    interior_prefix = mode == MUNCH_INTERIOR_PREFIX ? (bytes > 0 ? bytes : 1) : 0;
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+static void *alloc_large(size_t size, int type) {
+    size_t map_size = (size + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+    large_obj_t *lo = malloc(sizeof(large_obj_t));
+
+    if (lo == NULL)
+        return NULL;
+    lo->addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (lo->addr == MAP_FAILED) {
+        free(lo);
+        return NULL;
+    }
+    lo->size = size;
+    lo->map_size = map_size;
+    lo->noscan = type == TYPE_NOSCAN;
+    lo->typed = type > 0;
+    if (type > 0)
+        *(uintptr_t *) (lo->addr + size - sizeof(uintptr_t)) = type;
+    lo->cards = calloc(map_size >> MUNCH_CARD_SHIFT, 1); /* room to grow, see munch_realloc */
+    if (lo->cards == NULL) {
+        munmap(lo->addr, map_size);
+        free(lo);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    MAYBE_FINISH_CYCLE();
+    lo->marked = gc_marking;
+    if (!map_large_object(lo, lo)) {
+        pthread_mutex_unlock(&heap_lock);
+        munmap(lo->addr, map_size);
+        free(lo->cards);
+        free(lo);
+        return NULL;
+    }
+    num_mmaps += 1;
+    widen_scan_bounds(lo->addr, lo->addr + map_size);
+    lo->prev = NULL;
+    lo->next = large_objs;
+    if (large_objs != NULL)
+        large_objs->prev = lo;
+    large_objs = lo;
+    used_memory += size;
+    pthread_mutex_unlock(&heap_lock);
+    return lo->addr;
+}
+
+/*
+ * Objects of at least 'bytes' get their own mapping from now on. Anything at or below
+ * the small object limit is always served from slab pages.
+ */
+void munch_set_large_threshold(size_t bytes) {
+    large_threshold = bytes > MAX_SMALL_SIZE ? bytes : MAX_SMALL_SIZE + 1;
+}
+
+/*
+ * Scanning kernels. Most words on a stack or in a data segment aren't heap pointers at
+ * all, so each kernel first throws out everything outside [lo, lo + span) and only hands
+ * the rest to mark_pointer. The vector ones test several words per compare; x86 only has
+ * signed 64-bit compares, hence the sign bit flip on both sides.
+ */
+typedef void (*scan_kernel_t)(uintptr_t *sp, uintptr_t *end, uintptr_t lo, uintptr_t span);
+
+/* tests/munch_scan_kernel_test.c includes this file with its own, to see what gets through. */
+#ifndef SCAN_HIT
+#define SCAN_HIT mark_pointer
+#endif
+
+static void scan_words(uintptr_t *sp, uintptr_t *end, uintptr_t lo, uintptr_t span) {
+    for (; sp < end; sp++)
+        if (*sp - lo < span)
+            SCAN_HIT(*sp);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void scan_words_avx2(uintptr_t *sp, uintptr_t *end, uintptr_t lo, uintptr_t span) {
+    const __m256i sign = _mm256_set1_epi64x((long long) (1ULL << 63));
+    const __m256i vlo = _mm256_set1_epi64x((long long) lo);
+    const __m256i vspan = _mm256_xor_si256(_mm256_set1_epi64x((long long) span), sign);
+
+    for (; end - sp >= 8; sp += 8) {
+        __m256i a = _mm256_loadu_si256((__m256i *) sp);
+        __m256i b = _mm256_loadu_si256((__m256i *) (sp + 4));
+        a = _mm256_xor_si256(_mm256_sub_epi64(a, vlo), sign);
+        b = _mm256_xor_si256(_mm256_sub_epi64(b, vlo), sign);
+        unsigned hits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vspan, a))) |
+                        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(vspan, b))) << 4;
+        if (hits == 0)
+            continue;
+        /* mark_pointer is SSE code; calling it with the upper halves dirty costs a
+         * state transition on every call, and the compiler won't always clear them. */
+        _mm256_zeroupper();
+        for (; hits; hits &= hits - 1)
+            SCAN_HIT(sp[__builtin_ctz(hits)]);
+    }
+    _mm256_zeroupper();
+    scan_words(sp, end, lo, span);
+}
+
+/*
+ * SSE2 has no 64-bit compare at all. The high halves of four words fit in one register,
+ * though, so this one rejects whatever has its high half outside the bounds' and tests
+ * the few words left in full.
+ */
+static void scan_words_sse2(uintptr_t *sp, uintptr_t *end, uintptr_t lo, uintptr_t span) {
+    const __m128i sign = _mm_set1_epi32((int) 0x80000000);
+    const __m128i vlo = _mm_set1_epi32((int) (lo >> 32));
+    const __m128i vspan = _mm_xor_si128(_mm_set1_epi32((int) (((lo + span - 1) >> 32) - (lo >> 32) + 1)), sign);
+
+    if (span == 0)
+        return;
+    for (; end - sp >= 4; sp += 4) {
+        __m128 a = _mm_castsi128_ps(_mm_loadu_si128((__m128i *) sp));
+        __m128 b = _mm_castsi128_ps(_mm_loadu_si128((__m128i *) (sp + 2)));
+        __m128i high = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        high = _mm_xor_si128(_mm_sub_epi32(high, vlo), sign);
+        unsigned hits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(vspan, high)));
+        for (; hits; hits &= hits - 1) {
+            uintptr_t v = sp[__builtin_ctz(hits)];
+            if (v - lo < span)
+                SCAN_HIT(v);
+        }
+    }
+    scan_words(sp, end, lo, span);
+}
+#endif
+
+static scan_kernel_t scan_kernel = scan_words; /* picked by muncher_init */
+
+/*
+ * Scan a region of memory and mark anything it points to.
+ * Both arguments should be word aligned.
+ */
+static void scan_region(uintptr_t *sp, uintptr_t *end) {
+    uintptr_t lo = __atomic_load_n(&scan_lo, __ATOMIC_RELAXED);
+    uintptr_t hi = __atomic_load_n(&scan_hi, __ATOMIC_RELAXED);
+
+    scan_kernel(sp, end, lo, hi - lo);
+}
+
+/*
+ * The layout of a typed object that ends at end, or NULL if the id in its last word makes
+ * no sense (the program overwrote it).
+ */
+static inline type_layout_t *layout_of(uintptr_t *end) {
+    uintptr_t id = end[-1];
+
+    if (id == 0 || id >= (uintptr_t) __atomic_load_n(&num_types, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &types[id];
+}
+
+/*
+ * Scan [obj, end) with layout t, starting at its first word.
+ */
+static void scan_layout(uintptr_t *obj, uintptr_t *end, type_layout_t *t) {
+    for (; obj < end; obj += t->nwords) {
+        for (size_t w = 0; w < (t->nwords + 63) / 64; w++) {
+            for (uint64_t bits = t->bits[w]; bits != 0; bits &= bits - 1) {
+                uintptr_t *slot = obj + w * 64 + __builtin_ctzll(bits);
+                if (slot < end)
+                    mark_pointer(*slot);
+            }
+        }
+    }
+}
+
+/*
+ * Scan a typed object: only the words its layout marks, with the type id in the last word.
+ * An object with a bad id is scanned like any other.
+ */
+static void scan_typed(uintptr_t *obj, uintptr_t *end) {
+    type_layout_t *t = layout_of(end);
+
+    if (t == NULL)
+        scan_region(obj, end);
+    else
+        scan_layout(obj, end - 1, t);
+}
+
+static inline void scan_entry(mark_entry_t *e) {
+    if ((uintptr_t) e->start & TYPED_ENTRY)
+        scan_typed((uintptr_t *) ((char *) e->start - TYPED_ENTRY), e->end);
+    else
+        scan_region(e->start, e->end);
+}
+
+/*
+ * Pull a block of exactly num_units off the general free list, using a first-fit
+ * scan and splitting the front off bigger blocks. What's left stays right after the
+ * new block, so munch_realloc can grow it in place. Grows the heap if nothing fits.
+ */
+static header_t *take_from_free_list(size_t num_units) {
+    header_t *p, *prevp;
+
+    prevp = freep;
+    for (p = prevp->next;; prevp = p, p = p->next) {
+        if (p->size >= num_units) { /* Big enough. */
+            if (p->size == num_units) /* Exact size. */
+                prevp->next = p->next;
+            else {
+                header_t *rest = p + num_units;
+                rest->size = p->size - num_units;
+                rest->next = p->next;
+                prevp->next = rest;
+                p->size = num_units;
+            }
+            freep = prevp; /* p may have been freep, which the loop below relies on finding. */
+            return p;
+        }
+        if (p == freep) { /* Not enough memory. */
+            p = morecore(num_units);
+            if (p == NULL) /* Request for more memory failed. */
+                return NULL;
+        }
+    }
+}
+
+/*
+ * Hand a buffer's page for class c back to the shared heap. A page with slots left goes
+ * back on its class list; a full one is left alone until sweep frees something in it.
+ * Called with heap_lock held.
+ */
+static void tlab_release_page(tlab_class_t *tc, int c) {
+    page_info_t *page = tc->page;
+
+    if (page == NULL)
+        return;
+    page->free = tc->free;
+    page->bump = tc->bump;
+    /* A nursery page stays off the class lists until a minor collection has swept it. */
+    if ((page->free != NULL || page->bump < tc->limit) && !(generational && page->in_nursery)) {
+        page->next = class_pages[c];
+        class_pages[c] = page;
+    }
+    tc->page = NULL;
+    tc->free = NULL;
+    tc->bump = tc->limit = NULL;
+}
+
+/*
+ * Hand everything a buffer holds back to the shared heap. Called with heap_lock held.
+ */
+static void tlab_retire(tlab_t *t) {
+    for (int c = 0; c < NUM_SLAB_LISTS; c++)
+        tlab_release_page(&t->cls[c], c);
+    used_memory += t->allocated;
+    t->allocated = 0;
+}
+
+static void tlab_exit(void *arg) {
+    tlab_t *t = arg, **tp;
+
+    pthread_mutex_lock(&heap_lock);
+    tlab_retire(t);
+    for (tp = &tlabs; *tp != t; tp = &(*tp)->next)
+        ;
+    *tp = t->next;
+    pthread_mutex_unlock(&heap_lock);
+    free(t);
+}
+
+static tlab_t *tlab_create(void) {
+    tlab_t *t;
+
+    if (my_thread == NULL)
+        munch_register_thread();
+    if ((t = calloc(1, sizeof(tlab_t))) == NULL)
+        return NULL;
+
+    pthread_setspecific(tlab_key, t);
+    pthread_mutex_lock(&heap_lock);
+    t->next = tlabs;
+    tlabs = t;
+    pthread_mutex_unlock(&heap_lock);
+    return my_tlab = t;
+}
+
+/*
+ * Slow path for a small object: swap the buffer's exhausted page for one of class c that
+ * sweep left slots in, or failing that an empty page. Returns 0 if there's no memory.
+ */
+static int tlab_refill(tlab_t *t, int c) {
+    tlab_class_t *tc = &t->cls[c];
+    page_info_t *page;
+
+    pthread_mutex_lock(&heap_lock);
+    tlab_release_page(tc, c);
+    MAYBE_FINISH_CYCLE();
+    lazy_sweep_class(c);
+    if ((page = class_pages[c]) != NULL)
+        class_pages[c] = page->next;
+    else {
+        if ((page = get_empty_page(c >= NUM_SIZE_CLASSES)) == NULL) {
+            pthread_mutex_unlock(&heap_lock);
+            return 0;
+        }
+        page->size_class = c;
+        page->obj_size = CLASS_SIZE(c);
+        page->nobjs = HEAP_PAGE_SIZE / CLASS_SIZE(c);
+        page->free = NULL;
+        page->bump = page->base;
+        /* A concurrent mark may be looking at this page; let it see the sizes first. */
+        __atomic_store_n(&page->kind, PAGE_SLAB, __ATOMIC_RELEASE);
+    }
+    page->next = NULL;
+    if (generational && !page->in_nursery) {
+        page->in_nursery = 1;
+        page->nursery_next = nursery;
+        nursery = page;
+    }
+    /* An empty page an incremental sweep has yet to reach: it has nothing to sweep, and
+     * what we allocate in it isn't marked, so the sweep must pass it by. */
+    page->skip_sweep = !gc_marking && alloc_black(page->base);
+
+    /* Install it before unlocking, so a collector that retires buffers can't miss it. */
+    tc->page = page;
+    tc->black = gc_marking;
+    tc->free = page->free;
+    tc->bump = page->bump;
+    tc->limit = page->base + page->nobjs * page->obj_size;
+    pthread_mutex_unlock(&heap_lock);
+    return 1;
+}
+
+/*
+ * Allocate size bytes of an object of the given type: TYPE_CONSERVATIVE, TYPE_NOSCAN or
+ * a registered layout. Typed objects get an extra word at the end for the type id, which
+ * is written before the object can be seen. The layout is repeated right up to it, so
+ * whatever rounding up the size left between the object and its id is cleared: it could
+ * hold stale addresses from whatever was there before. If zeroed isn't NULL it's set to whether the
+ * memory is known to be all zero already.
+ */
+static inline void *allocate(size_t size, int type, int *zeroed) {
+    // check to see if we need to trigger garbage collection
+    // TODO we will probably want to move this somewhere nicer eventually
+    //float usage = (float)used_memory / total_memory;
+    //if(usage > 0.75) {
+    /*
+    if(usage > 0.0001) {
+	printf("going to MUNCH!... using %d bytes \n", used_memory);
+	muncher_collect();
+    }
+    */
+    
+
+    size_t num_units;
+    header_t *p;
+
+    if (type > 0)
+        size += sizeof(uintptr_t);
+    if (size <= MAX_SMALL_SIZE) {
+        /* Common case: pop or bump out of this thread's page, no locking. */
+        tlab_t *t = my_tlab;
+        int c = size_class[(size + (1 << GRANULE_SHIFT) - 1) >> GRANULE_SHIFT] +
+                (type == TYPE_NOSCAN ? NUM_SIZE_CLASSES : 0);
+        tlab_class_t *tc;
+        char *obj;
+
+        if (t == NULL && (t = tlab_create()) == NULL)
+            return NULL;
+        tc = &t->cls[c];
+
+        for (;;) {
+            /* A stop that arrives in here waits until the buffer is consistent again. */
+            in_alloc = 1;
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+            if ((obj = tc->free) != NULL) {
+                tc->free = *(void **) obj;
+                if (zeroed != NULL)
+                    *zeroed = 0;
+            } else if (tc->bump < tc->limit) {
+                obj = tc->bump;
+                tc->bump += CLASS_SIZE(c);
+                if (zeroed != NULL)
+                    *zeroed = tc->page->fresh;
+            }
+            if (obj != NULL) {
+                if (type > 0) {
+                    memset(obj + size - sizeof(uintptr_t), 0, CLASS_SIZE(c) - size);
+                    *(uintptr_t *) (obj + CLASS_SIZE(c) - sizeof(uintptr_t)) = type;
+                }
+                set_object_type(tc->page, (obj - tc->page->base) >> GRANULE_SHIFT, type);
+                __atomic_signal_fence(__ATOMIC_RELEASE);
+                BIT_SET(tc->page->alloc_bits, (obj - tc->page->base) >> GRANULE_SHIFT);
+                if (tc->black)
+                    test_and_set_mark(obj);
+                t->allocated += CLASS_SIZE(c);
+            }
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+            in_alloc = 0;
+            if (stop_deferred)
+                stop_self();
+
+            if (obj != NULL)
+                return obj;
+            if (!tlab_refill(t, c))
+                return NULL;
+        }
+    }
+
+    if (my_thread == NULL)
+        munch_register_thread();
+    if (size >= large_threshold) {
+        if (zeroed != NULL)
+            *zeroed = 1; /* a new mapping */
+        return alloc_large(size, type);
+    }
+    if (zeroed != NULL)
+        *zeroed = 0;
+
+    num_units = (size + sizeof(header_t) - 1) / sizeof(header_t) + 1;  
+
+    pthread_mutex_lock(&heap_lock);
+    MAYBE_FINISH_CYCLE();
+    p = take_from_free_list(num_units);
+    if (p != NULL) {
+        page_info_t *owner = &page_table[PAGE_INDEX(p)];
+        if (type > 0) {
+            memset((char *) (p + 1) + size - sizeof(uintptr_t), 0, (p->size - 1) * sizeof(header_t) - size);
+            *(uintptr_t *) ((char *) (p + p->size) - sizeof(uintptr_t)) = type;
+        }
+        set_object_type(owner, ((char *) p - owner->base) >> GRANULE_SHIFT, type);
+        set_block_allocated(p, 1);
+        if (alloc_black(p))
+            test_and_set_mark(p);
+        if (generational && !page_table[PAGE_INDEX(p)].in_nursery) {
+            page_info_t *page = &page_table[PAGE_INDEX(p)];
+            page->in_nursery = 1;
+            page->nursery_next = nursery;
+            nursery = page;
+        }
+        used_memory += num_units * sizeof(header_t); // We are now using this many extra bytes of memory in total
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return p == NULL ? NULL : (void *) (p + 1);
+}
+
+void *munch_alloc(size_t size) {
+    return allocate(size, TYPE_CONSERVATIVE, NULL);
+}
+
+/*
+ * Allocate a zeroed array of nmemb objects of size bytes. Large objects and slots that
+ * have never been used in a page fresh from the arena are zero already, so only the rest
+ * get cleared.
+ */
+void *munch_calloc(size_t nmemb, size_t size) {
+    size_t bytes;
+    int zeroed;
+    void *p;
+
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+        return NULL;
+    if ((p = allocate(bytes, TYPE_CONSERVATIVE, &zeroed)) != NULL && !zeroed)
+        memset(p, 0, bytes);
+    return p;
+}
+
+/*
+ * Allocate an object that will never hold pointers into the heap, such as a byte buffer
+ * or an array of numbers. It's kept alive like any other object but never scanned, so
+ * whatever it holds can't keep anything else alive.
+ */
+void *munch_alloc_atomic(size_t size) {
+    return allocate(size, TYPE_NOSCAN, NULL);
+}
+
+/*
+ * Register an object layout: bit i of layout (word i / 64, bit i % 64) says whether word
+ * i of an object can hold a pointer, for i < nwords. Objects longer than that repeat it,
+ * so an array of structs can use the layout of one. Returns the type id to pass to
+ * munch_alloc_typed, or -1 on failure.
+ */
+int munch_register_type(const uint64_t *layout, size_t nwords) {
+    size_t n = (nwords + 63) / 64;
+    uint64_t *bits;
+    int id;
+
+    if (nwords == 0 || (bits = malloc(n * sizeof(uint64_t))) == NULL)
+        return -1;
+    memcpy(bits, layout, n * sizeof(uint64_t));
+    if (nwords % 64 != 0)
+        bits[n - 1] &= (1ULL << (nwords % 64)) - 1;
+
+    pthread_mutex_lock(&heap_lock);
+    if ((id = num_types) == MAX_TYPES) {
+        pthread_mutex_unlock(&heap_lock);
+        free(bits);
+        return -1;
+    }
+    types[id].bits = bits;
+    types[id].nwords = nwords;
+    __atomic_store_n(&num_types, id + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&heap_lock);
+    return id;
+}
+
+/*
+ * Allocate an object whose pointers are where the registered layout 'type' says.
+ * Everything else in it is ignored by the marker.
+ */
+void *munch_alloc_typed(size_t size, int type) {
+    if (type <= 0 || type >= __atomic_load_n(&num_types, __ATOMIC_ACQUIRE))
+        return NULL;
+    return allocate(size, type, NULL);
+}
+
+/*
+ * The free block before the one at p on the free list, or NULL if p isn't free.
+ */
+static header_t *free_block_before(header_t *p) {
+    header_t *q, *prevp = freep;
+
+    for (q = prevp->next; q != p; prevp = q, q = q->next)
+        if (q == freep)
+            return NULL;
+    return prevp;
+}
+
+/*
+ * Grow a used header_t block to num_units over the free block right after it, if there
+ * is one and it's big enough; at the top of the heap, the heap grows to make it so. A
+ * typed block's id is moved to its new end before a marker can see the new size.
+ * Called with heap_lock held.
+ */
+static int grow_block(header_t *bp, size_t num_units, int type) {
+    header_t *next = bp + bp->size, *p, *prevp;
+    size_t extra = num_units - bp->size, have;
+
+    prevp = free_block_before(next);
+    have = prevp != NULL ? prevp->next->size : 0;
+    if (have < extra && (char *) (next + have) == heap_frontier) {
+        /*
+         * Take the pages straight off the frontier, blacklisted or not: they become part
+         * of a live object, which a stray pointer can't make any more live than it is.
+         */
+        size_t npages = ((extra - have) * sizeof(header_t) + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+        char *vp = arena_take_pages(heap_frontier, npages);
+
+        if (vp == NULL)
+            return 0;
+        add_block_pages(vp, npages);
+        prevp = free_block_before(next);
+        have = prevp != NULL ? prevp->next->size : 0;
+    }
+    if (have < extra)
+        return 0;
+    p = prevp->next;
+    if (p->size == extra)
+        prevp->next = p->next;
+    else {
+        header_t *rest = p + extra;
+        rest->size = p->size - extra;
+        rest->next = p->next;
+        prevp->next = rest;
+    }
+    if (freep == p)
+        freep = prevp;
+    if (type > 0) {
+        /* The old id and whatever the free block held become slack, see allocate. */
+        memset((char *) (bp + bp->size) - sizeof(uintptr_t), 0, extra * sizeof(header_t));
+        *(uintptr_t *) ((char *) (bp + num_units) - sizeof(uintptr_t)) = type;
+    }
+    __atomic_store_n(&bp->size, num_units, __ATOMIC_RELEASE);
+    set_block_allocated(bp, 1); /* the pages it now reaches into have to find it */
+    used_memory += extra * sizeof(header_t);
+    return 1;
+}
+
+/*
+ * Move a large object's pages to a bigger mapping of map_size bytes, which the kernel
+ * does by moving page table entries: nothing is copied. The new range is reserved, and
+ * the page map made ready for it, before anything is moved, so nothing can fail after.
+ * Called with heap_lock held.
+ */
+static int move_large_object(large_obj_t *lo, size_t map_size) {
+    large_obj_t to = { .map_size = map_size };
+
+    to.addr = mmap(NULL, map_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (to.addr == MAP_FAILED)
+        return 0;
+    if (!map_large_object(&to, NULL) ||
+        mremap(lo->addr, lo->map_size, map_size, MREMAP_MAYMOVE | MREMAP_FIXED, to.addr) == MAP_FAILED) {
+        munmap(to.addr, map_size);
+        return 0;
+    }
+    map_large_object(lo, NULL);
+    lo->addr = to.addr;
+    lo->map_size = map_size;
+    map_large_object(lo, lo);
+    return 1;
+}
+
+/*
+ * Grow a large object to size bytes. Its mapping is extended in place if the pages after
+ * it are free, and otherwise moved, unless a mark is running: a marker may be scanning
+ * it where it is. Like grow_block, it moves a typed object's id first. Called with
+ * heap_lock held.
+ */
+static int grow_large(large_obj_t *lo, size_t size, int type) {
+    size_t map_size = (size + HEAP_PAGE_SIZE - 1) & ~(HEAP_PAGE_SIZE - 1);
+    size_t old_map_size = lo->map_size;
+    unsigned char *cards;
+
+    if (map_size > old_map_size) {
+        if ((cards = realloc(lo->cards, map_size >> MUNCH_CARD_SHIFT)) == NULL)
+            return 0;
+        memset(cards + (old_map_size >> MUNCH_CARD_SHIFT), 0, (map_size - old_map_size) >> MUNCH_CARD_SHIFT);
+        lo->cards = cards;
+        if (mremap(lo->addr, old_map_size, map_size, 0) != MAP_FAILED) {
+            lo->map_size = map_size;
+            if (!map_large_object(lo, lo)) {
+                map_large_object(lo, NULL);
+                lo->map_size = old_map_size;
+                map_large_object(lo, lo);
+                mremap(lo->addr, map_size, old_map_size, 0);
+                return 0;
+            }
+        } else if (gc_marking || !move_large_object(lo, map_size))
+            return 0;
+        widen_scan_bounds(lo->addr, lo->addr + map_size);
+    }
+    if (type > 0)
+        *(uintptr_t *) (lo->addr + size - sizeof(uintptr_t)) = type;
+    used_memory += size - lo->size;
+    __atomic_store_n(&lo->size, size, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Resize an object, keeping its kind: conservative, atomic or typed. It stays where it
+ * is if it still fits its slot, or if it's a header_t block and the free block after it
+ * can take the rest. A large object's mapping is extended, or moved without copying.
+ * Otherwise the contents move to a new object and the old one is left to the collector.
+ * Returns NULL, leaving ptr alone, if there's no memory or ptr isn't from munch_alloc.
+ */
+void *munch_realloc(void *ptr, size_t size) {
+    uintptr_t v = (uintptr_t) ptr;
+    size_t old_size, extra;
+    int type;
+    char *end;
+    void *p;
+
+    if (ptr == NULL)
+        return munch_alloc(size);
+
+    if (IN_HEAP(v) && page_table[PAGE_INDEX(v)].kind == PAGE_SLAB) {
+        page_info_t *page = &page_table[PAGE_INDEX(v)];
+        size_t g = (v - (uintptr_t) page->base) >> GRANULE_SHIFT;
+
+        if ((v - (uintptr_t) page->base) % page->obj_size != 0 || !BIT_TEST(page->alloc_bits, g))
+            return NULL;
+        end = (char *) ptr + page->obj_size;
+        type = BIT_TEST(page->noscan_bits, g) ? TYPE_NOSCAN :
+               BIT_TEST(page->typed_bits, g) ? (int) ((uintptr_t *) end)[-1] : TYPE_CONSERVATIVE;
+        extra = type > 0 ? sizeof(uintptr_t) : 0;
+        old_size = page->obj_size - extra;
+        if (size <= old_size)
+            return ptr;
+    } else if (IN_HEAP(v)) {
+        header_t *bp = (header_t *) ptr - 1;
+        size_t num_units;
+        int grown;
+
+        if (!IN_HEAP(bp) || page_table[PAGE_INDEX(bp)].kind != PAGE_BLOCK ||
+            block_at(&page_table[PAGE_INDEX(bp)], (uintptr_t) bp) != bp)
+            return NULL;
+        end = (char *) (bp + bp->size);
+        type = NOSCAN(bp) ? TYPE_NOSCAN : TYPED(bp) ? (int) ((uintptr_t *) end)[-1] : TYPE_CONSERVATIVE;
+        extra = type > 0 ? sizeof(uintptr_t) : 0;
+        old_size = (char *) end - (char *) ptr - extra;
+        if (size <= old_size)
+            return ptr;
+        num_units = (size + extra + sizeof(header_t) - 1) / sizeof(header_t) + 1;
+        if (size + extra < large_threshold) {
+            pthread_mutex_lock(&heap_lock);
+            grown = grow_block(bp, num_units, type);
+            pthread_mutex_unlock(&heap_lock);
+            if (grown)
+                return ptr;
+        }
+    } else {
+        large_obj_t *lo = large_object_of(v);
+        int grown;
+
+        if (lo == NULL || v != (uintptr_t) lo->addr)
+            return NULL;
+        end = lo->addr + lo->size;
+        type = lo->noscan ? TYPE_NOSCAN : lo->typed ? (int) ((uintptr_t *) end)[-1] : TYPE_CONSERVATIVE;
+        extra = type > 0 ? sizeof(uintptr_t) : 0;
+        old_size = lo->size - extra;
+        if (size <= old_size)
+            return ptr;
+        pthread_mutex_lock(&heap_lock);
+        grown = grow_large(lo, size + extra, type);
+        p = lo->addr;
+        pthread_mutex_unlock(&heap_lock);
+        if (grown)
+            return p;
+    }
+
+    if ((p = allocate(size, type, NULL)) != NULL)
+        memcpy(p, ptr, old_size);
+    return p;
+}
+
+
+void muncher_cleanup(void) {
+    printf("number of allocs: %d\n", num_mmaps);
+    fflush(stdout);
+}
+
+
+
+
+/*
+ * Helper threads for marking and sweeping are started once and then wait for work,
+ * since starting a thread isn't safe while the world is stopped. run_gc_workers posts a
+ * job by bumping gc_job; helpers 1..job_helpers run it.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static void *(*job_fn)(void *);
+static unsigned long gc_job;
+static int job_helpers, job_running;
+static int pool_size;           /* helpers started so far */
+
+static void *pool_main(void *arg) {
+    int id = (int) (intptr_t) arg;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        void *(*fn)(void *);
+
+        while (workers[id].job == gc_job)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        workers[id].job = gc_job;
+        if (id > job_helpers)
+            continue;
+        fn = job_fn;
+        pthread_mutex_unlock(&pool_lock);
+        fn(&workers[id]);
+        pthread_mutex_lock(&pool_lock);
+        if (--job_running == 0)
+            pthread_cond_signal(&pool_done);
+    }
+    return NULL;
+}
+
+/*
+ * (Re)size the marking workers to num_threads, starting helpers for any new ones.
+ */
+static void setup_mark_workers(void) {
+    if (num_threads > workers_size) {
+        /* Never shrunk: helpers started for a bigger pool still look at their entries. */
+        pthread_mutex_lock(&pool_lock);
+        workers = realloc(workers, num_threads * sizeof(gc_worker_t));
+        if (workers == NULL)
+            exit(1);
+        for (int i = workers_size; i < num_threads; i++) {
+            memset(&workers[i], 0, sizeof(gc_worker_t));
+            pthread_spin_init(&workers[i].lock, PTHREAD_PROCESS_PRIVATE);
+            workers[i].id = i;
+            workers[i].job = gc_job;
+        }
+        workers_size = num_threads;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    while (pool_size < num_threads - 1) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, pool_main, (void *) (intptr_t) (pool_size + 1)) != 0)
+            break; /* run_gc_workers makes do with the ones we have */
+        pthread_detach(thread);
+        pool_size++;
+    }
+    num_workers = num_threads;
+}
+
+/*
+ * Set stuff up, and register the calling thread.
+ */
+void muncher_init(void) {
+    static int initted;
+    struct sigaction sa;
+
+    if (initted)
+        return;
+
+    initted = 1;
+
+    get_num_threads();
+    setup_mark_workers();
+
+    pthread_key_create(&tlab_key, tlab_exit);
+    pthread_key_create(&mutator_key, mutator_exit);
+
+    /* SIG_RESTART stays blocked in the suspend handler until it's waited for. */
+    sem_init(&suspend_ack, 0, 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = suspend_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIG_RESTART);
+    sigaction(SIG_SUSPEND, &sa, NULL);
+    sa.sa_handler = restart_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIG_RESTART, &sa, NULL);
+
+    atexit(muncher_cleanup); // specify that we want to call 'muncher_cleanup()' right before program exit to clean up
+
+    /* Reserve the whole heap now; morecore only ever commits pieces of it. */
+    heap_lo = mmap(NULL, total_memory, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    page_table = mmap(NULL, (total_memory >> HEAP_PAGE_SHIFT) * sizeof(page_info_t),
+                      PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    mark_bits = mmap(NULL, (total_memory >> GRANULE_SHIFT) / 8,
+                     PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    munch_cards = mmap(NULL, total_memory >> MUNCH_CARD_SHIFT,
+                       PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    black_pages = mmap(NULL, (total_memory >> HEAP_PAGE_SHIFT) / 8,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    new_black_pages = mmap(NULL, (total_memory >> HEAP_PAGE_SHIFT) / 8,
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (heap_lo == MAP_FAILED || page_table == MAP_FAILED || mark_bits == MAP_FAILED ||
+        munch_cards == MAP_FAILED || black_pages == MAP_FAILED || new_black_pages == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    heap_hi = heap_lo + total_memory;
+    black_hi = heap_lo + BLACKLIST_WINDOW;
+    widen_scan_bounds(heap_lo, black_hi);
+    munch_cards_lo = heap_lo;
+    munch_cards_hi = heap_hi;
+    large_map = mmap(NULL, (MAP_MASK + 1) * sizeof(large_obj_t **), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (large_map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    heap_committed = heap_frontier = heap_lo;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    scan_kernel = __builtin_cpu_supports("avx2") ? scan_words_avx2 : scan_words_sse2;
+#endif
+    dead_blocks = calloc(total_memory / ARENA_CHUNK_SIZE, sizeof(header_t *));
+    if (dead_blocks == NULL)
+        exit(1);
+
+    base.next = freep = &base;
+    //freep = NULL;
+    base.next = &base;
+    base.size = 0;
+
+    for (int c = 0, g = 0; g <= (MAX_SMALL_SIZE >> GRANULE_SHIFT); g++) {
+        if ((g << GRANULE_SHIFT) > class_size[c])
+            c++;
+        size_class[g] = c;
+    }
+
+    munch_register_thread();
+}
+
+
+/*
+ * Scan the marked blocks for references to other unmarked blocks: pop grey objects off
+ * this worker's deque and scan them until it's empty. Each object is pushed at most
+ * once, so marking is linear in the size of the live heap.
+ *
+ * Popped objects wait in a small FIFO before they're scanned, with their first line
+ * prefetched on the way in, so the miss on one overlaps with scanning the ones before it.
+ * munch_set_mark_prefetch(0) turns that off, for comparison.
+ */
+#define PREFETCH_DEPTH 8
+
+static int mark_prefetch = 1;
+
+static void scan_heap(void) {
+    gc_worker_t *w = my_worker;
+    mark_entry_t fifo[PREFETCH_DEPTH], e;
+    size_t head = 0, tail = 0;
+
+    if (!__atomic_load_n(&mark_prefetch, __ATOMIC_RELAXED)) {
+        while (mark_stack_pop(w, &e))
+            scan_entry(&e);
+        return;
+    }
+    for (;;) {
+        while (tail - head < PREFETCH_DEPTH && mark_stack_pop(w, &e)) {
+            /* Only we push onto our deque, so if this was the last entry and nothing is
+             * queued there's nothing to overlap its miss with: scan it right away. */
+            if (head == tail && __atomic_load_n(&w->tail, __ATOMIC_RELAXED) == __atomic_load_n(&w->head, __ATOMIC_RELAXED)) {
+                scan_entry(&e);
+                continue;
+            }
+            __builtin_prefetch(e.start);
+            fifo[tail++ % PREFETCH_DEPTH] = e;
+        }
+        if (head == tail)
+            break;
+        e = fifo[head++ % PREFETCH_DEPTH];
+        scan_entry(&e);
+    }
+}
+
+/*
+ * Move up to half of another worker's deque (oldest entries first) onto ours.
+ */
+static int steal_work(gc_worker_t *w) {
+    mark_entry_t batch[STEAL_BATCH];
+
+    for (int k = 1; k < num_workers; k++) {
+        gc_worker_t *victim = &workers[(w->id + k) % num_workers];
+        size_t n = 0, take;
+
+        if (__atomic_load_n(&victim->tail, __ATOMIC_RELAXED) == __atomic_load_n(&victim->head, __ATOMIC_RELAXED))
+            continue;
+        pthread_spin_lock(&victim->lock);
+        take = (victim->tail - victim->head + 1) / 2;
+        while (n < take && n < STEAL_BATCH)
+            batch[n++] = victim->deque[victim->head++ & (victim->size - 1)];
+        pthread_spin_unlock(&victim->lock);
+
+        for (size_t i = 0; i < n; i++)
+            mark_stack_push(batch[i].start, batch[i].end);
+        if (n > 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int work_available(void) {
+    for (int i = 0; i < num_workers; i++) {
+        if (__atomic_load_n(&workers[i].tail, __ATOMIC_RELAXED) != __atomic_load_n(&workers[i].head, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Body of a marking thread: claim pieces of the roots until they run out, then keep
+ * draining our own deque and stealing from the others. We're done once every worker is
+ * idle at the same time, since only a busy worker can create new grey objects.
+ */
+static void *mark_worker_main(void *arg) {
+    gc_worker_t *w = arg;
+    size_t i;
+
+    my_worker = w;
+    while ((i = __atomic_fetch_add(&next_root_chunk, 1, __ATOMIC_RELAXED)) < num_root_chunks) {
+        scan_region(root_chunks[i].start, root_chunks[i].end);
+        scan_heap();
+    }
+
+    for (;;) {
+        scan_heap();
+        if (steal_work(w))
+            continue;
+        __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) == num_workers)
+                return NULL;
+            if (work_available()) {
+                __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Queue [start, end) for root scanning, cut into ROOT_CHUNK_SIZE pieces so the workers
+ * can share it out. The queue grows with mmap rather than realloc, since this runs with
+ * the world stopped.
+ */
+static void add_root_range(uintptr_t *start, uintptr_t *end) {
+    while (start < end) {
+        uintptr_t *stop = end - start > ROOT_CHUNK_SIZE / sizeof(uintptr_t) ? start + ROOT_CHUNK_SIZE / sizeof(uintptr_t) : end;
+
+        if (num_root_chunks == root_chunks_size) {
+            size_t size = root_chunks_size ? root_chunks_size * 2 : 1024;
+            mark_entry_t *chunks = mmap(NULL, size * sizeof(mark_entry_t), PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunks == MAP_FAILED) {
+                /* Can't queue it, so scan it right here instead. */
+                scan_region(start, end);
+                return;
+            }
+            memcpy(chunks, root_chunks, num_root_chunks * sizeof(mark_entry_t));
+            if (root_chunks != NULL)
+                munmap(root_chunks, root_chunks_size * sizeof(mark_entry_t));
+            root_chunks = chunks;
+            root_chunks_size = size;
+        }
+        root_chunks[num_root_chunks].start = start;
+        root_chunks[num_root_chunks].end = stop;
+        num_root_chunks++;
+        start = stop;
+    }
+}
+
+/*
+ * Static roots: the writable data of every loaded object, unless munch_set_data_roots(0)
+ * turned that off, plus whatever ranges were registered with munch_add_roots. Protected
+ * by heap_lock.
+ */
+typedef struct {
+    uintptr_t *start, *end;
+} root_range_t;
+
+static int data_roots = 1;
+static root_range_t *static_roots;
+static size_t num_static_roots, static_roots_size;
+
+/*
+ * Set when roots are added while a concurrent or incremental mark is running. What they
+ * hold was written before the cycle started tracking writes, so the remark scans them
+ * all rather than just their dirty pages.
+ */
+static int roots_added;
+
+/*
+ * The data segments are the PF_W PT_LOAD segments of the executable and every shared
+ * object, less their PT_GNU_RELRO part, which the dynamic linker makes read-only once
+ * it has done the relocations. The list is kept between collections and only rebuilt
+ * when the loader's dlpi_adds/dlpi_subs counters say something was loaded or unloaded.
+ * The munch_private section, wherever it was linked, is cut out.
+ */
+static root_range_t *data_segments;
+static size_t num_data_segments, data_segments_size;
+static unsigned long long seen_adds, seen_subs;
+static int have_data_segments;
+
+static void add_data_segment(uintptr_t lo, uintptr_t hi) {
+    uintptr_t own_lo = (uintptr_t) __start_munch_private, own_hi = (uintptr_t) __stop_munch_private;
+
+    if (own_lo < hi && own_hi > lo) {
+        add_data_segment(lo, own_lo);
+        add_data_segment(own_hi, hi);
+        return;
+    }
+    lo = (lo + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    hi &= ~(sizeof(uintptr_t) - 1);
+    if (lo >= hi)
+        return;
+    if (num_data_segments == data_segments_size) {
+        data_segments_size = data_segments_size ? data_segments_size * 2 : 32;
+        data_segments = realloc(data_segments, data_segments_size * sizeof(root_range_t));
+        if (data_segments == NULL)
+            exit(1);
+    }
+    data_segments[num_data_segments].start = (uintptr_t *) lo;
+    data_segments[num_data_segments].end = (uintptr_t *) hi;
+    num_data_segments++;
+}
+
+static int find_data_segments(struct dl_phdr_info *info, size_t size, void *arg) {
+    int *first = arg;
+    uintptr_t relro_lo = 0, relro_hi = 0;
+
+    if (*first) {
+        *first = 0;
+        if (size < offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+            have_data_segments = 0; /* no counters, so look every time */
+        else if (have_data_segments && info->dlpi_adds == seen_adds && info->dlpi_subs == seen_subs)
+            return 1;
+        else {
+            seen_adds = info->dlpi_adds;
+            seen_subs = info->dlpi_subs;
+            have_data_segments = 1;
+        }
+        num_data_segments = 0;
+    }
+
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+        if (ph->p_type == PT_GNU_RELRO) {
+            relro_lo = info->dlpi_addr + ph->p_vaddr;
+            relro_hi = relro_lo + ph->p_memsz;
+        }
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        uintptr_t lo, hi;
+
+        if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+            continue;
+        lo = info->dlpi_addr + ph->p_vaddr;
+        hi = lo + ph->p_memsz;
+        if (relro_lo < relro_hi && relro_lo < hi && relro_hi > lo) {
+            add_data_segment(lo, relro_lo);
+            add_data_segment(relro_hi, hi);
+        } else
+            add_data_segment(lo, hi);
+    }
+    return 0;
+}
+
+/*
+ * Bring the data segments up to date. dl_iterate_phdr takes the loader's lock, which a
+ * stopped thread could be holding, so this has to happen before the world stops.
+ */
+static void update_data_segments(void) {
+    int first = 1;
+
+    if (data_roots)
+        dl_iterate_phdr(find_data_segments, &first);
+}
+
+/*
+ * Scan [start, end) for pointers into the heap at every collection. Returns 0, or -1 if
+ * there was no memory to remember the range.
+ */
+int munch_add_roots(void *start, void *end) {
+    uintptr_t *lo = (uintptr_t *) (((uintptr_t) start + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1));
+    uintptr_t *hi = (uintptr_t *) ((uintptr_t) end & ~(sizeof(uintptr_t) - 1));
+
+    if (lo >= hi)
+        return 0;
+    pthread_mutex_lock(&heap_lock);
+    if (num_static_roots == static_roots_size) {
+        size_t size = static_roots_size ? static_roots_size * 2 : 16;
+        root_range_t *roots = realloc(static_roots, size * sizeof(root_range_t));
+
+        if (roots == NULL) {
+            pthread_mutex_unlock(&heap_lock);
+            return -1;
+        }
+        static_roots = roots;
+        static_roots_size = size;
+    }
+    static_roots[num_static_roots].start = lo;
+    static_roots[num_static_roots].end = hi;
+    num_static_roots++;
+    if (gc_marking)
+        roots_added = 1;
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+/*
+ * Forget every registered range that lies within [start, end).
+ */
+void munch_remove_roots(void *start, void *end) {
+    size_t i = 0;
+
+    pthread_mutex_lock(&heap_lock);
+    while (i < num_static_roots) {
+        if ((char *) static_roots[i].start >= (char *) start && (char *) static_roots[i].end <= (char *) end)
+            static_roots[i] = static_roots[--num_static_roots];
+        else
+            i++;
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void munch_set_data_roots(int on) {
+    pthread_mutex_lock(&heap_lock);
+    if (on && !data_roots && gc_marking)
+        roots_added = 1;
+    data_roots = on;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void add_static_roots(void) {
+    for (size_t i = 0; data_roots && i < num_data_segments; i++)
+        add_root_range(data_segments[i].start, data_segments[i].end);
+    for (size_t i = 0; i < num_static_roots; i++)
+        add_root_range(static_roots[i].start, static_roots[i].end);
+}
+
+/*
+ * Run fn on the calling thread and num_workers - 1 helpers, each given its own worker.
+ */
+static void run_gc_workers(void *(*fn)(void *)) {
+    int helpers = pool_size < num_workers - 1 ? pool_size : num_workers - 1;
+
+    idle_workers = num_workers - 1 - helpers; /* a worker that never runs counts as idle for good */
+    if (helpers > 0) {
+        pthread_mutex_lock(&pool_lock);
+        job_fn = fn;
+        job_helpers = job_running = helpers;
+        gc_job++;
+        pthread_cond_broadcast(&pool_wake);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    fn(&workers[0]);
+    if (helpers > 0) {
+        pthread_mutex_lock(&pool_lock);
+        while (job_running > 0)
+            pthread_cond_wait(&pool_done, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+/*
+ * The mark stack overflowed, so some marked objects were never scanned. Rescan every
+ * marked object in the heap (draining as we go) until a pass gets through cleanly.
+ */
+static void recover_mark_overflow(void) {
+    while (mark_stack_overflow) {
+        mark_stack_overflow = 0;
+
+        for (size_t i = 0; i < PAGE_INDEX(heap_frontier); i++) {
+            page_info_t *page = &page_table[i];
+            uint64_t *marks = &mark_bits[i * BITMAP_WORDS];
+
+            if (page->kind != PAGE_SLAB && page->kind != PAGE_BLOCK)
+                continue;
+            for (int w = 0; w < BITMAP_WORDS; w++) {
+                uint64_t bits = marks[w];
+                while (bits != 0) {
+                    char *obj = page->base + (((size_t) w * 64 + __builtin_ctzll(bits)) << GRANULE_SHIFT);
+                    bits &= bits - 1;
+                    if (NOSCAN(obj))
+                        continue;
+                    if (page->kind == PAGE_SLAB && TYPED(obj))
+                        scan_typed((uintptr_t *) obj, (uintptr_t *) (obj + page->obj_size));
+                    else if (page->kind == PAGE_SLAB)
+                        scan_region((uintptr_t *) obj, (uintptr_t *) (obj + page->obj_size));
+                    else if (TYPED(obj))
+                        scan_typed((uintptr_t *) ((header_t *) obj + 1),
+                                   (uintptr_t *) ((header_t *) obj + ((header_t *) obj)->size));
+                    else
+                        scan_region((uintptr_t *) ((header_t *) obj + 1),
+                                    (uintptr_t *) ((header_t *) obj + ((header_t *) obj)->size));
+                    scan_heap();
+                }
+            }
+        }
+        for (large_obj_t *lo = large_objs; lo != NULL; lo = lo->next) {
+            if (lo->marked && !lo->noscan && lo->typed) {
+                scan_typed((uintptr_t *) lo->addr, (uintptr_t *) (lo->addr + lo->size));
+                scan_heap();
+            } else if (lo->marked && !lo->noscan) {
+                scan_region((uintptr_t *) lo->addr, (uintptr_t *) (lo->addr + lo->size));
+                scan_heap();
+            }
+        }
+    }
+}
+
+
+/*
+ * Mark everything reachable. Called with the world stopped.
+ */
+void mark(void) {
+    if (heap_frontier == heap_lo && large_objs == NULL)
+        return;
+
+    my_worker = &workers[0];
+
+    /* Mark from every thread's registers, and queue its stack. */
+    add_thread_roots(add_root_range);
+
+    /* Scan the BSS and initialized data segments, and any registered roots. */
+    add_static_roots();
+
+    /* Mark from the roots and then the heap, spread over all the workers. */
+    next_root_chunk = 0;
+    run_gc_workers(mark_worker_main);
+    num_root_chunks = 0;
+    recover_mark_overflow();
+}
+
+/*
+ * Sweep a slab page. The page's marks simply become its alloc bits; everything that was
+ * allocated but not marked is threaded onto the page's free list, and the page goes on
+ * *empty or its class's list depending on what's left alive. Returns the bytes freed.
+ */
+static size_t sweep_slab_page(page_info_t *page, uint64_t *marks, page_info_t **empty, page_info_t **classes) {
+    int before = 0, live = 0;
+    void **freelist = NULL;
+
+    for (int i = 0; i < BITMAP_WORDS; i++) {
+        before += __builtin_popcountll(page->alloc_bits[i]);
+        page->alloc_bits[i] &= marks[i];
+        live += __builtin_popcountll(page->alloc_bits[i]);
+    }
+    if (live == 0) {
+        page->kind = PAGE_FREE;
+        page->next = *empty;
+        *empty = page;
+        return (size_t) before * page->obj_size;
+    }
+
+    for (size_t slot = page->nobjs; live < page->nobjs && slot-- > 0;) {
+        char *obj = page->base + slot * page->obj_size;
+        if (!BIT_TEST(page->alloc_bits, (obj - page->base) >> GRANULE_SHIFT)) {
+            *(void **) obj = freelist;
+            freelist = (void **) obj;
+        }
+    }
+    page->free = freelist;
+    page->bump = page->base + page->nobjs * page->obj_size;
+    if (freelist != NULL) {
+        page->next = classes[page->size_class];
+        classes[page->size_class] = page;
+    }
+    return (size_t) (before - live) * page->obj_size;
+}
+
+/*
+ * Sweep one page left behind by a lazy sweep. Called with heap_lock held.
+ */
+static void lazy_sweep_page(page_info_t *page) {
+    uint64_t *marks = &mark_bits[PAGE_INDEX(page->base) * BITMAP_WORDS];
+
+    used_memory -= sweep_slab_page(page, marks, &empty_pages, class_pages);
+    memset(marks, 0, BITMAP_WORDS * sizeof(uint64_t));
+}
+
+/*
+ * Sweep pending pages of class c until one of them has room for an object, or there are
+ * none left. Called with heap_lock held.
+ */
+static void lazy_sweep_class(int c) {
+    page_info_t *page;
+
+    while (class_pages[c] == NULL && empty_pages == NULL && (page = sweep_pending[c]) != NULL) {
+        sweep_pending[c] = page->next;
+        lazy_sweep_page(page);
+    }
+}
+
+/*
+ * Sweep one page a lazy sweep left behind, if there is one. Returns 0 if there wasn't.
+ * Called with heap_lock held.
+ */
+static int lazy_sweep_one(void) {
+    page_info_t *page;
+
+    for (int c = 0; c < NUM_SLAB_LISTS; c++) {
+        if ((page = sweep_pending[c]) != NULL) {
+            sweep_pending[c] = page->next;
+            lazy_sweep_page(page);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Catch up on everything a lazy sweep left behind, so the next mark starts from clean
+ * mark bits. Bounded by the number of slab pages at the last collection.
+ */
+static void finish_lazy_sweep(void) {
+    while (lazy_sweep_one())
+        ;
+}
+
+void munch_set_lazy_sweep(int on) {
+    pthread_mutex_lock(&heap_lock);
+    lazy_sweep = on;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+void munch_set_mark_prefetch(int on) {
+    __atomic_store_n(&mark_prefetch, on, __ATOMIC_RELAXED);
+}
+
+/*
+ * Find the header_t blocks starting in a PAGE_BLOCK page that weren't marked, and queue
+ * them on *tail in address order. Giving them back to the free list means coalescing
+ * with neighbours that may belong to other chunks, so that waits for sweep's merge.
+ */
+static header_t **sweep_block_page(gc_worker_t *w, page_info_t *page, uint64_t *marks, header_t **tail) {
+    for (int i = 0; i < BITMAP_WORDS; i++) {
+        uint64_t dead = page->alloc_bits[i] & ~marks[i];
+
+        page->alloc_bits[i] &= ~dead;
+        while (dead != 0) {
+            header_t *bp = (header_t *) (page->base + (((size_t) i * 64 + __builtin_ctzll(dead)) << GRANULE_SHIFT));
+            dead &= dead - 1;
+            w->freed += bp->size * sizeof(header_t);
+            *tail = bp;
+            tail = &bp->next;
+        }
+    }
+    return tail;
+}
+
+/*
+ * Sweep work is handed out an arena chunk at a time.
+ */
+
+static void *sweep_worker_main(void *arg) {
+    gc_worker_t *w = arg;
+    size_t chunk, last = PAGE_INDEX(heap_frontier);
+
+    while ((chunk = __atomic_fetch_add(&next_sweep_chunk, 1, __ATOMIC_RELAXED)) < num_sweep_chunks) {
+        size_t first = chunk * CHUNK_PAGES, stop = first + CHUNK_PAGES < last ? first + CHUNK_PAGES : last;
+        header_t **tail = &dead_blocks[chunk];
+
+        for (size_t i = first; i < stop; i++) {
+            page_info_t *page = &page_table[i];
+            uint64_t *marks = &mark_bits[i * BITMAP_WORDS];
+
+            page->in_nursery = 0;
+            if (page->kind == PAGE_SLAB && lazy_sweep && !keep_marks) {
+                /* Leave it, marks and all, for the allocator to sweep when it needs the room. */
+                page->next = w->pending[page->size_class];
+                w->pending[page->size_class] = page;
+                continue;
+            }
+            if (page->kind == PAGE_SLAB)
+                w->freed += sweep_slab_page(page, marks, &w->empty_pages, w->class_pages);
+            else if (page->kind == PAGE_BLOCK)
+                tail = sweep_block_page(w, page, marks, tail);
+            if (lazy_sweep && !keep_marks)
+                memset(marks, 0, BITMAP_WORDS * sizeof(uint64_t));
+        }
+        *tail = NULL;
+
+        /* Everything has been consumed, start the next cycle with a clean bitmap. */
+        if (!lazy_sweep && !keep_marks)
+            memset(&mark_bits[first * BITMAP_WORDS], 0, (stop - first) * BITMAP_WORDS * sizeof(uint64_t));
+    }
+    return NULL;
+}
+
+static void free_large_object(large_obj_t *lo) {
+    if (lo->prev != NULL)
+        lo->prev->next = lo->next;
+    else
+        large_objs = lo->next;
+    if (lo->next != NULL)
+        lo->next->prev = lo->prev;
+    if (old_large == lo)
+        old_large = lo->next;
+    used_memory -= lo->size;
+    map_large_object(lo, NULL);
+    if (munmap(lo->addr, lo->map_size) == -1)
+        perror("munmap");
+    free(lo->cards);
+    free(lo);
+}
+
+/*
+ * Unmap every large object that wasn't marked.
+ */
+static void sweep_large_objects(void) {
+    large_obj_t *lo, *next;
+
+    for (lo = large_objs; lo != NULL; lo = next) {
+        next = lo->next;
+        if (lo->marked) {
+            if (!keep_marks)
+                lo->marked = 0;
+            continue;
+        }
+        free_large_object(lo);
+    }
+}
+
+/*
+ * After a full mark: what it blacklisted replaces what the one before did, and the holes
+ * nothing points at any more go back to empty_pages. Called with heap_lock held.
+ */
+static void age_blacklist(void) {
+    uint64_t *old = black_pages;
+    page_info_t **pp = &black_holes, *page;
+
+    black_pages = new_black_pages;
+    memset(old, 0, (PAGE_INDEX(black_hi) + 63) / 64 * sizeof(uint64_t));
+    new_black_pages = old;
+    while ((page = *pp) != NULL) {
+        if (BIT_TEST(black_pages, PAGE_INDEX(page->base)))
+            pp = &page->next;
+        else {
+            *pp = page->next;
+            page->black = 0;
+            page->next = empty_pages;
+            empty_pages = page;
+        }
+    }
+}
+
+/*
+ * Sweep the arena in parallel, one arena chunk at a time, then fold what each worker
+ * found back into the shared lists.
+ */
+void sweep(void) {
+    header_t *bp, *next;
 
+    age_blacklist();
 
-    statfp = fopen("/proc/self/stat", "r");
-    assert(statfp != NULL);
-    fscanf(statfp,
-           "%*d %*s %*c %*d %*d %*d %*d %*d %*u "
-           "%*lu %*lu %*lu %*lu %*lu %*lu %*ld %*ld "
-           "%*ld %*ld %*ld %*ld %*llu %*lu %*ld "
-           "%*lu %*lu %*lu %lu", &stack_bottom);
-    fclose(statfp);
+    for (int i = 0; i < num_workers; i++) {
+        gc_worker_t *w = &workers[i];
+        w->empty_pages = NULL;
+        memset(w->class_pages, 0, sizeof(w->class_pages));
+        memset(w->pending, 0, sizeof(w->pending));
+        w->freed = 0;
+    }
+    num_sweep_chunks = (PAGE_INDEX(heap_frontier) + CHUNK_PAGES - 1) / CHUNK_PAGES;
+    next_sweep_chunk = 0;
+    run_gc_workers(sweep_worker_main);
+    nursery = NULL; /* every page in it has been swept */
+
+    /* The class lists are rebuilt from scratch; every page with room is on some worker's list. */
+    for (int c = 0; c < NUM_SLAB_LISTS; c++)
+        class_pages[c] = NULL;
+    for (int i = 0; i < num_workers; i++) {
+        gc_worker_t *w = &workers[i];
+        page_info_t *page;
+
+        while ((page = w->empty_pages) != NULL) {
+            w->empty_pages = page->next;
+            page->next = empty_pages;
+            empty_pages = page;
+        }
+        for (int c = 0; c < NUM_SLAB_LISTS; c++) {
+            while ((page = w->class_pages[c]) != NULL) {
+                w->class_pages[c] = page->next;
+                page->next = class_pages[c];
+                class_pages[c] = page;
+            }
+            while ((page = w->pending[c]) != NULL) {
+                w->pending[c] = page->next;
+                page->next = sweep_pending[c];
+                sweep_pending[c] = page;
+            }
+        }
+        used_memory -= w->freed;
+    }
 
-    usedp = NULL;
-    base.next = freep = &base;
-    //freep = NULL;
-    base.next = &base;
-    base.size = 0;
+    /*
+     * Chunks in order give the dead blocks in ascending address order, and add_to_free_list
+     * starts each search where the last one left off, so this is one pass over the free list.
+     */
+    for (size_t chunk = 0; chunk < num_sweep_chunks; chunk++) {
+        for (bp = dead_blocks[chunk]; bp != NULL; bp = next) {
+            next = bp->next;
+            add_to_free_list(bp);
+        }
+    }
+
+    sweep_large_objects();
+}
 
+/*
+ * Fork collection. The child gets a real copy-on-write snapshot of the heap from the
+ * kernel, marks it with nobody else running, and writes the address of every allocation
+ * it found dead down a pipe, followed by a 0. Garbage in the snapshot is still garbage
+ * in the parent however far the mutator has got since, so the parent can take the list
+ * as the complement of its marks: everything allocated now is marked except what the
+ * child reported, and the ordinary sweep does the rest.
+ */
+#define DEAD_BATCH 512
+
+/*
+ * Set while a fork collection's child is marking. No other sweep may run until its dead
+ * list has been used: it could hand out an address the child saw as dead, and the list
+ * would then free the new object. Protected by heap_lock.
+ */
+static int fork_in_progress;
+static pthread_cond_t fork_done = PTHREAD_COND_INITIALIZER;
 
-    regs = malloc(sizeof(RegisterSnapshot));
+/*
+ * Wait until no fork collection is under way. Every sweep outside collect_fork goes
+ * through here first. Called with heap_lock held, which it lets go of while waiting.
+ */
+static void wait_for_fork(void) {
+    while (fork_in_progress)
+        pthread_cond_wait(&fork_done, &heap_lock);
 }
 
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
 
 /*
- * Scan the marked blocks for references to other unmarked blocks.
+ * The child's side: mark, then report whatever has an alloc bit and no mark.
  */
-static void scan_heap(void) {
-    uintptr_t *vp;
-    header_t *bp, *up;
+static void report_dead(int fd) {
+    uintptr_t batch[DEAD_BATCH];
+    size_t n = 0;
+
+    mark();
+    for (size_t i = 0; i < PAGE_INDEX(heap_frontier); i++) {
+        page_info_t *page = &page_table[i];
+        uint64_t *marks = &mark_bits[i * BITMAP_WORDS];
 
-    for (bp = UNTAG(usedp->next); bp != usedp; bp = UNTAG(bp->next)) {
-        if (!((uintptr_t)bp->next & 1))
+        if (page->kind != PAGE_SLAB && page->kind != PAGE_BLOCK)
             continue;
-        for (vp = (uintptr_t *)(bp + 1);
-             vp < (bp + bp->size + 1);
-             vp++) {
-            uintptr_t v = *vp;
-            up = UNTAG(bp->next);
-            do {
-                if (up != bp &&
-                    up + 1 <= v &&
-                    up + 1 + up->size > v) {
-                    up->next = ((uintptr_t) up->next) | 1;
-                    break;
+        for (int w = 0; w < BITMAP_WORDS; w++) {
+            uint64_t dead = page->alloc_bits[w] & ~marks[w];
+            while (dead != 0) {
+                batch[n++] = (uintptr_t) page->base + (((size_t) w * 64 + __builtin_ctzll(dead)) << GRANULE_SHIFT);
+                dead &= dead - 1;
+                if (n == DEAD_BATCH) {
+                    if (write_all(fd, batch, sizeof(batch)) == -1)
+                        _exit(1);
+                    n = 0;
                 }
-            } while ((up = UNTAG(up->next)) != bp);
+            }
         }
     }
+    for (large_obj_t *lo = large_objs; lo != NULL; lo = lo->next) {
+        if (!lo->marked) {
+            batch[n++] = (uintptr_t) lo->addr;
+            if (n == DEAD_BATCH) {
+                if (write_all(fd, batch, sizeof(batch)) == -1)
+                    _exit(1);
+                n = 0;
+            }
+        }
+    }
+    batch[n++] = 0;
+    if (write_all(fd, batch, n * sizeof(uintptr_t)) == -1)
+        _exit(1);
+    _exit(0);
+}
+
+/*
+ * The parent's side: read the dead list, which only returns once the child has finished
+ * marking. Returns the number of addresses in *out, or -1 if the child didn't finish.
+ */
+static ssize_t read_dead(int fd, pid_t pid, uintptr_t **out) {
+    uintptr_t *dead = NULL;
+    size_t n = 0, size = 0, bytes = 0;
+    int status, done = 0;
+
+    for (;;) {
+        ssize_t got;
+
+        if (bytes + DEAD_BATCH * sizeof(uintptr_t) > size * sizeof(uintptr_t)) {
+            uintptr_t *bigger;
+            size = size ? size * 2 : DEAD_BATCH * 4;
+            if ((bigger = realloc(dead, size * sizeof(uintptr_t))) == NULL)
+                break;
+            dead = bigger;
+        }
+        got = read(fd, (char *) dead + bytes, DEAD_BATCH * sizeof(uintptr_t));
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        bytes += got;
+    }
+    n = bytes / sizeof(uintptr_t);
+    if (n > 0 && bytes % sizeof(uintptr_t) == 0 && dead[n - 1] == 0)
+        done = 1;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (!done || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        free(dead);
+        return -1;
+    }
+    *out = dead;
+    return n - 1;
 }
 
+/*
+ * Turn the child's dead list into marks: every allocation the parent has now is marked,
+ * then the dead ones are unmarked again. Called with heap_lock held.
+ */
+static void mark_all_but(uintptr_t *dead, size_t n) {
+    for (size_t i = 0; i < PAGE_INDEX(heap_frontier); i++) {
+        page_info_t *page = &page_table[i];
 
-void mark(void) {
-    uintptr_t stack_top;
-    extern char end, etext; /* Provided by the linker. */
+        if (page->kind == PAGE_SLAB || page->kind == PAGE_BLOCK)
+            memcpy(&mark_bits[i * BITMAP_WORDS], page->alloc_bits, sizeof(page->alloc_bits));
+    }
+    for (large_obj_t *lo = large_objs; lo != NULL; lo = lo->next)
+        lo->marked = 1;
+
+    for (size_t i = 0; i < n; i++) {
+        large_obj_t *lo;
+
+        if (IN_HEAP(dead[i])) {
+            size_t g = GRANULE_INDEX(dead[i]);
+            mark_bits[g >> 6] &= ~(1ULL << (g & 63));
+        } else if ((lo = large_object_of(dead[i])) != NULL && (uintptr_t) lo->addr == dead[i])
+            lo->marked = 0;
+    }
+}
 
+static void collect_fork(void) {
+    uintptr_t *dead;
+    ssize_t n;
+    int fds[2];
+    pid_t pid;
 
-    if (usedp == NULL)
+    pthread_mutex_lock(&heap_lock);
+    if (concurrent_state != CYCLE_IDLE) { /* the mode changed halfway through a cycle */
+        finish_concurrent_cycle();
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    if (step_state != STEP_IDLE) { /* likewise for an incremental one */
+        while (collect_step(UINT64_MAX))
+            ;
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    if (fork_in_progress) { /* somebody else's child is already on it */
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    finish_lazy_sweep();
+    clear_sticky_marks();
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    /*
+     * Fork with the world stopped, so the child sees every thread's stack at a safepoint.
+     * That rules out fork(), whose atfork handlers take locks a stopped thread may hold;
+     * the child never touches malloc or stdio, so the raw system call is enough.
+     */
+    stop_world();
+    if ((pid = syscall(SYS_fork)) == 0) {
+        pool_size = 0; /* the helper threads didn't come along */
+        close(fds[0]);
+        report_dead(fds[1]);
+    }
+    start_world();
+    close(fds[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    fork_in_progress = 1;
+    pthread_mutex_unlock(&heap_lock);
+
+    /* The mutator carries on while the child marks. */
+    n = read_dead(fds[0], pid, &dead);
+    close(fds[0]);
+    pthread_mutex_lock(&heap_lock);
+    fork_in_progress = 0;
+    pthread_cond_broadcast(&fork_done); /* they wake up once we let go of heap_lock */
+    if (n < 0) {
+        pthread_mutex_unlock(&heap_lock);
         return;
+    }
 
-    printf("in mark\n");
-    fflush(stdout);
+    /* With the buffers retired nobody can allocate until we let go of heap_lock. */
+    stop_world();
+    start_world();
+    mark_all_but(dead, n);
+    sweep();
+    pthread_mutex_unlock(&heap_lock);
+    free(dead);
+}
 
-    /* Scan the BSS and initialized data segments. */
-    scan_region(&etext, &end);
+/*
+ * Soft-dirty tracking: writing 4 to clear_refs clears the soft-dirty bit on every page of
+ * the process, and the kernel sets it again (bit 55 of the page's pagemap entry) on the
+ * next write. Kernels built without it accept the write and never set the bit, so a
+ * probe page checks that it actually works before we rely on it.
+ */
+#define PM_SOFT_DIRTY (1ULL << 55)
+#define PAGEMAP_BATCH 512
 
-    printf("scanned bss\n");
-    fflush(stdout);
+static int soft_dirty;          /* tracking is live for the current cycle */
+static char *soft_dirty_probe;
+static pthread_t concurrent_thread;
+static int concurrent_thread_started;
 
-    /* Scan the stack. */
-    asm volatile ("movq %%rbp, %0" : "=r" (stack_top));
-    scan_region(stack_top, stack_bottom);
+static int page_is_dirty(int fd, char *p) {
+    uint64_t entry;
 
-    printf("scanned stack\n");
-    fflush(stdout);
+    if (pread(fd, &entry, sizeof(entry), ((uintptr_t) p >> HEAP_PAGE_SHIFT) * sizeof(entry)) != sizeof(entry))
+        return -1;
+    return (entry & PM_SOFT_DIRTY) != 0;
+}
 
-    /* Mark from the heap. */
-    //scan_heap();
+static int clear_soft_dirty(void) {
+    int fd, ok;
 
-    //printf("scanned heap\n");
-    //fflush(stdout);
+    if (soft_dirty_probe == NULL) {
+        soft_dirty_probe = mmap(NULL, HEAP_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (soft_dirty_probe == MAP_FAILED) {
+            soft_dirty_probe = NULL;
+            return 0;
+        }
+    }
+    if ((fd = open("/proc/self/clear_refs", O_WRONLY)) == -1)
+        return 0;
+    ok = write(fd, "4", 1) == 1;
+    close(fd);
+    if (!ok || (fd = open("/proc/self/pagemap", O_RDONLY)) == -1)
+        return 0;
+    ok = page_is_dirty(fd, soft_dirty_probe) == 0;
+    *(volatile char *) soft_dirty_probe = 1;
+    ok = ok && page_is_dirty(fd, soft_dirty_probe) == 1;
+    close(fd);
+    return ok;
+}
 
-    /* We want to get a snapshot of the register values at this particular moment in time,
-     * so we can check for references */
-    capture_registers();
+/*
+ * Call fn on every run of dirty pages in [start, end), clipped to [start, end). Returns
+ * how many pages were dirty, or -1 if pagemap couldn't be read, in which case fn may
+ * have seen some of them already.
+ */
+static int for_each_dirty_range(int fd, char *start, char *end, void (*fn)(char *, char *)) {
+    uint64_t entries[PAGEMAP_BATCH];
+    uintptr_t first = (uintptr_t) start >> HEAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) end + HEAP_PAGE_SIZE - 1) >> HEAP_PAGE_SHIFT;
+    char *run = NULL;
+    int dirty = 0;
+
+    for (uintptr_t i = first; i < last; i += PAGEMAP_BATCH) {
+        size_t n = last - i < PAGEMAP_BATCH ? last - i : PAGEMAP_BATCH;
+
+        if (pread(fd, entries, n * sizeof(uint64_t), i * sizeof(uint64_t)) != (ssize_t) (n * sizeof(uint64_t)))
+            return -1;
+        for (size_t k = 0; k < n; k++) {
+            char *page = (char *) ((i + k) << HEAP_PAGE_SHIFT);
+            dirty += (entries[k] & PM_SOFT_DIRTY) != 0;
+            if ((entries[k] & PM_SOFT_DIRTY) && run == NULL)
+                run = page < start ? start : page;
+            else if (!(entries[k] & PM_SOFT_DIRTY) && run != NULL) {
+                fn(run, page);
+                run = NULL;
+            }
+        }
+    }
+    if (run != NULL)
+        fn(run, end);
+    return dirty;
+}
 
-    /* Mark from registers. */
-    mark_register_roots();
+static void rescan_root(char *start, char *end) {
+    add_root_range((uintptr_t *) start, (uintptr_t *) end);
+}
 
-    //printf("scanned regs\n");
-    //fflush(stdout);
+/*
+ * Rescan the part of an object that falls in [lo, hi): all of it, or for a typed object
+ * the words its layout marks, starting from the layout boundary at or before lo.
+ */
+static void rescan_part(char *obj, char *end, int typed, char *lo, char *hi) {
+    type_layout_t *t;
 
+    if (typed && (t = layout_of((uintptr_t *) end)) != NULL) {
+        size_t skip = lo > obj ? (size_t) (lo - obj) / (t->nwords * sizeof(uintptr_t)) * t->nwords : 0;
+        end -= sizeof(uintptr_t); /* the id */
+        scan_layout((uintptr_t *) obj + skip, (uintptr_t *) (hi < end ? hi : end), t);
+    } else
+        rescan_root(obj > lo ? obj : lo, end < hi ? end : hi);
 }
 
-void sweep(void) {
-    header_t *p, *prevp, *tp;
-    size_t pagesize = getpagesize();
-
-    /* And now we collect! */
-    for (prevp = usedp, p = UNTAG(usedp->next);; prevp = p, p = UNTAG(p->next)) {
-    next_chunk:
-        if (!((unsigned int)p->next & 1)) {
-            /*
-             * The chunk hasn't been marked. Thus, it must be set free. 
-             */
-	    // decrement total size usage
-	    printf("sweeping block!, size: %d\n", p->size);
-	    fflush(stdout);
-
-	    used_memory -= p->size;
-
-            tp = p;
-            p = UNTAG(p->next);
-
-	    // Unmap the freed chunk
-            size_t block_size = tp->size * sizeof(header_t);
-	    size_t aligned_size = (block_size + pagesize - 1) & ~(pagesize - 1);
-
-	    printf("aligned size: %d\n", aligned_size);
-	    fflush(stdout);
-	    printf("tp: %d\n", tp);
-	    fflush(stdout);
-
-            if (munmap(tp->mmap_addr, aligned_size) == -1) {
-                perror("munmap");
-                // Handle the error appropriately
+/*
+ * Rescan the marked objects that overlap [lo, hi), a range within one arena page, leaving
+ * out atomic objects and whatever isn't marked: free slots, and in a minor collection the
+ * young objects, which are only live if something else points at them. Only the parts
+ * of objects that fall in the range need looking at; their other parts get their own turn
+ * if they're dirty too.
+ */
+static void rescan_objects(page_info_t *page, char *lo, char *hi) {
+    uint64_t *marks = &mark_bits[(page - page_table) * BITMAP_WORDS];
+    header_t *bp;
+
+    if (page->kind == PAGE_BLOCK && (bp = page->block) != NULL && (char *) bp < page->base &&
+        IS_MARKED(bp) && !NOSCAN(bp) && (char *) (bp + bp->size) > lo)
+        rescan_part((char *) (bp + 1), (char *) (bp + bp->size), TYPED(bp), lo, hi);
+    if (page->kind != PAGE_SLAB && page->kind != PAGE_BLOCK)
+        return;
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        uint64_t bits = marks[w];
+        while (bits != 0) {
+            size_t g = (size_t) w * 64 + __builtin_ctzll(bits);
+            char *obj = page->base + (g << GRANULE_SHIFT), *end;
+            bits &= bits - 1;
+            if (obj >= hi)
+                return;
+            if (BIT_TEST(page->noscan_bits, g))
+                continue;
+            if (page->kind == PAGE_SLAB)
+                end = obj + page->obj_size;
+            else {
+                end = (char *) ((header_t *) obj + ((header_t *) obj)->size);
+                obj = (char *) ((header_t *) obj + 1);
             }
-            //add_to_free_list(tp);
+            if (end > lo)
+                rescan_part(obj, end, BIT_TEST(page->typed_bits, g), lo, hi);
+        }
+    }
+}
 
-            if (usedp == tp) { 
-                usedp = NULL;
-                break;
+static void rescan_heap_page(page_info_t *page) {
+    rescan_objects(page, page->base, page->base + HEAP_PAGE_SIZE);
+}
+
+static large_obj_t *dirty_large; /* the large object rescan_dirty is looking at */
+
+static void rescan_large_range(char *start, char *end) {
+    rescan_part(dirty_large->addr, dirty_large->addr + dirty_large->size, dirty_large->typed, start, end);
+}
+
+static void rescan_heap_pages(char *start, char *end) {
+    for (size_t i = PAGE_INDEX(start); i < PAGE_INDEX(end); i++)
+        rescan_heap_page(&page_table[i]);
+}
+
+static void *concurrent_mark_main(void *arg) {
+    (void) arg;
+    my_worker = &workers[0];
+    next_root_chunk = 0;
+    run_gc_workers(mark_worker_main);
+    num_root_chunks = 0;
+    recover_mark_overflow();
+    __atomic_store_n(&concurrent_state, CYCLE_MARKED, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Start a concurrent cycle: queue the roots as they are now, start tracking writes, and
+ * hand the mark to a background thread. Called with heap_lock held.
+ */
+static void start_concurrent_cycle(void) {
+    finish_lazy_sweep();
+    clear_sticky_marks();
+
+    stop_world();
+    soft_dirty = clear_soft_dirty();
+    __atomic_store_n(&gc_marking, 1, __ATOMIC_RELEASE);
+    my_worker = &workers[0];
+    add_thread_roots(scan_region);
+    add_static_roots();
+    start_world();
+
+    concurrent_state = CYCLE_MARKING;
+    concurrent_thread_started = pthread_create(&concurrent_thread, NULL, concurrent_mark_main, NULL) == 0;
+    if (!concurrent_thread_started)
+        concurrent_mark_main(NULL);
+}
+
+/*
+ * Queue everything written since soft-dirty bits were last cleared: dirty pages of the
+ * static roots and of marked large objects, and the marked objects in dirty arena pages.
+ * Returns the number of dirty pages, or -1 if there's no telling.
+ */
+static int rescan_dirty(void) {
+    int fd, n, total = 0;
+
+    if (!soft_dirty || (fd = open("/proc/self/pagemap", O_RDONLY)) == -1)
+        return -1;
+    for (size_t i = 0; data_roots && i < num_data_segments && total >= 0; i++) {
+        if ((n = for_each_dirty_range(fd, (char *) data_segments[i].start, (char *) data_segments[i].end, rescan_root)) >= 0)
+            total += n;
+        else
+            total = -1;
+    }
+    for (size_t i = 0; i < num_static_roots && total >= 0; i++) {
+        if ((n = for_each_dirty_range(fd, (char *) static_roots[i].start, (char *) static_roots[i].end, rescan_root)) >= 0)
+            total += n;
+        else
+            total = -1;
+    }
+    if (total >= 0 && (n = for_each_dirty_range(fd, heap_lo, heap_frontier, rescan_heap_pages)) >= 0)
+        total += n;
+    else
+        total = -1;
+    for (large_obj_t *lo = large_objs; lo != NULL && total >= 0; lo = lo->next) {
+        if (!lo->marked || lo->noscan)
+            continue;
+        dirty_large = lo;
+        if ((n = for_each_dirty_range(fd, lo->addr, lo->addr + lo->size, rescan_large_range)) >= 0)
+            total += n;
+        else
+            total = -1;
+    }
+    close(fd);
+    return total;
+}
+
+/*
+ * The final pause of a concurrent or incremental mark: rescan every thread's registers
+ * and stack, whatever was written while the mutator ran and any roots added meanwhile,
+ * and finish marking. Without soft-dirty bits there's no telling what was written, so
+ * every marked object is rescanned instead. Called with heap_lock held and the world
+ * stopped.
+ */
+static void remark(void) {
+    my_worker = &workers[0];
+    add_thread_roots(add_root_range);
+
+    if (rescan_dirty() == -1) {
+        add_static_roots();
+        mark_stack_overflow = 1; /* makes recover_mark_overflow rescan every marked object */
+    } else if (roots_added)
+        add_static_roots();
+    roots_added = 0;
+
+    next_root_chunk = 0;
+    run_gc_workers(mark_worker_main);
+    num_root_chunks = 0;
+    recover_mark_overflow();
+}
+
+/*
+ * Finish a concurrent cycle: wait for the mark, remark and sweep. Called with heap_lock
+ * held.
+ */
+static void finish_concurrent_cycle(void) {
+    if (concurrent_thread_started)
+        pthread_join(concurrent_thread, NULL);
+    concurrent_thread_started = 0;
+
+    stop_world();
+    remark();
+    __atomic_store_n(&gc_marking, 0, __ATOMIC_RELEASE);
+    concurrent_state = CYCLE_IDLE;
+    start_world();
+    sweep();
+}
+
+/*
+ * Incremental collection. Each step does units of work until the budget runs out,
+ * checking the clock every STEP_CHECK_INTERVAL units. A unit scans at most SCAN_SLICE
+ * words, or sweeps or rescans one page. Writes the mutator makes between steps are
+ * picked up the same way as for a concurrent mark: allocate black, and rescan
+ * soft-dirty pages. Before the final remark, a few preclean rounds queue the pages
+ * dirtied so far and clear their bits in a short pause, and rescan them outside it,
+ * until the dirty set is small.
+ */
+#define STEP_CHECK_INTERVAL 32
+#define SCAN_SLICE 512
+#define PRECLEAN_ROUNDS 4
+#define PRECLEAN_PAGES 64   /* remark once a round finds no more dirty pages than this */
+
+static int preclean_rounds;
+static size_t rescan_cursor, rescan_end;  /* overflow recovery, a page at a time */
+static int rescanning;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Start an incremental cycle. collect_step has already finished any lazy sweep, a page
+ * per unit. Called with heap_lock held.
+ */
+static void start_step_cycle(void) {
+    clear_sticky_marks();
+
+    stop_world();
+    soft_dirty = clear_soft_dirty();
+    __atomic_store_n(&gc_marking, 1, __ATOMIC_RELEASE);
+    my_worker = &workers[0];
+    add_thread_roots(scan_region);
+    add_static_roots();
+    start_world();
+    next_root_chunk = 0;
+    preclean_rounds = 0;
+    step_state = STEP_MARK;
+}
+
+/*
+ * One unit of marking: a slice of a grey object or a root chunk, or one page of overflow
+ * recovery. Returns 0 when there's nothing left.
+ */
+static int mark_unit(void) {
+    mark_entry_t e;
+
+    if (mark_stack_pop(my_worker, &e) ||
+        (next_root_chunk < num_root_chunks && (e = root_chunks[next_root_chunk++], 1))) {
+        if ((uintptr_t) e.start & TYPED_ENTRY) {
+            /* Typed objects are sliced on whole repeats of their layout, so the rest can
+             * start again from its first word; it keeps the id at its end. */
+            uintptr_t *obj = (uintptr_t *) ((char *) e.start - TYPED_ENTRY);
+            type_layout_t *t = layout_of(e.end);
+            size_t slice;
+
+            if (t == NULL)
+                e.start = obj; /* gets scanned conservatively, so slice it that way */
+            else {
+                slice = t->nwords * (SCAN_SLICE > t->nwords ? SCAN_SLICE / t->nwords : 1);
+                if ((size_t) (e.end - 1 - obj) > slice) {
+                    mark_stack_push((char *) (obj + slice) + TYPED_ENTRY, e.end);
+                    scan_layout(obj, obj + slice, t);
+                    return 1;
+                }
             }
+        }
+        if (!((uintptr_t) e.start & TYPED_ENTRY) && e.end - e.start > SCAN_SLICE) {
+            mark_stack_push(e.start + SCAN_SLICE, e.end);
+            e.end = e.start + SCAN_SLICE;
+        }
+        scan_entry(&e);
+        return 1;
+    }
+    num_root_chunks = next_root_chunk = 0;
 
-            prevp->next = (uintptr_t)p | ((uintptr_t) prevp->next & 1);
-            goto next_chunk;
+    if (rescan_cursor < rescan_end) {
+        rescan_heap_page(&page_table[rescan_cursor++]);
+        return 1;
+    }
+    if (rescanning) {
+        for (large_obj_t *lo = large_objs; lo != NULL; lo = lo->next) {
+            if (lo->marked && !lo->noscan && lo->typed)
+                mark_stack_push(lo->addr + TYPED_ENTRY, lo->addr + lo->size);
+            else if (lo->marked && !lo->noscan)
+                rescan_root(lo->addr, lo->addr + lo->size);
         }
-        p->next = ((uintptr_t) p->next) & ~1;
-        if (p == usedp)
+        rescanning = 0;
+        return 1;
+    }
+    if (mark_stack_overflow) {
+        mark_stack_overflow = 0;
+        rescanning = 1;
+        rescan_cursor = 0;
+        rescan_end = PAGE_INDEX(heap_frontier);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Marking has run dry: either preclean and keep going, or remark and move on to the
+ * sweep. Returns whether there's more marking to do.
+ */
+static int end_of_mark(void) {
+    int dirty;
+
+    if (soft_dirty && preclean_rounds < PRECLEAN_ROUNDS) {
+        /*
+         * Reading the dirty bits and clearing them has to be one step: a write that got
+         * in between would lose its bit without having been seen. rescan_dirty only
+         * queues the pages, so the pause is short, and they're scanned after it.
+         */
+        preclean_rounds++;
+        stop_world();
+        dirty = rescan_dirty();
+        soft_dirty = clear_soft_dirty();
+        start_world();
+        if (dirty > PRECLEAN_PAGES && soft_dirty)
+            return 1;
+        if (dirty == -1 || !soft_dirty)
+            return 1; /* lost track, and the remark will rescan everything anyway */
+    }
+
+    stop_world();
+    remark();
+    __atomic_store_n(&gc_marking, 0, __ATOMIC_RELEASE);
+    start_world();
+    age_blacklist();
+
+    /* Large objects are few enough to sweep in the pause; the rest is done incrementally. */
+    sweep_large_objects();
+    for (int c = 0; c < NUM_SLAB_LISTS; c++)
+        class_pages[c] = NULL;
+    sweep_cursor = 0;
+    sweep_end = PAGE_INDEX(heap_frontier);
+    nursery = NULL;
+    step_state = STEP_SWEEP;
+    return 0;
+}
+
+/*
+ * Sweep one page on behalf of munch_collect_step, queueing dead blocks on *tail.
+ */
+static header_t **sweep_unit(header_t **tail) {
+    page_info_t *page = &page_table[sweep_cursor];
+    uint64_t *marks = &mark_bits[sweep_cursor * BITMAP_WORDS];
+
+    page->in_nursery = 0;
+    if (page->skip_sweep)
+        page->skip_sweep = 0; /* a buffer took it empty, see tlab_refill */
+    else if (page->kind == PAGE_SLAB)
+        used_memory -= sweep_slab_page(page, marks, &empty_pages, class_pages);
+    else if (page->kind == PAGE_BLOCK)
+        tail = sweep_block_page(&workers[0], page, marks, tail);
+    memset(marks, 0, BITMAP_WORDS * sizeof(uint64_t));
+    sweep_cursor++;
+    return tail;
+}
+
+/*
+ * Do collection work until the deadline passes. Returns whether the cycle has further to
+ * go. Does nothing while a fork collection is under way: collect_fork finishes any
+ * incremental cycle before it forks, so none can start or sweep until the child is done.
+ * Called with heap_lock held.
+ */
+static int collect_step(uint64_t deadline) {
+    header_t *dead = NULL, **tail = &dead, *bp, *next;
+    int n = 0, more = 1;
+
+    if (fork_in_progress)
+        return 1;
+    /* Pages a lazy sweep left behind still hold the last cycle's marks. */
+    while (step_state == STEP_IDLE && lazy_sweep_one()) {
+        if (++n % STEP_CHECK_INTERVAL == 0 && now_ns() >= deadline)
+            return 1;
+    }
+    if (step_state == STEP_IDLE)
+        start_step_cycle();
+    my_worker = &workers[0];
+
+    while (step_state == STEP_MARK) {
+        if (!mark_unit() && !end_of_mark())
+            break;
+        if (++n % STEP_CHECK_INTERVAL == 0 && now_ns() >= deadline)
+            return 1;
+    }
+
+    /* The remark retired every buffer, and since then they only take pages the sweep
+     * has been through or will skip. */
+    workers[0].freed = 0;
+    while (sweep_cursor < sweep_end) {
+        tail = sweep_unit(tail);
+        if (++n % STEP_CHECK_INTERVAL == 0 && now_ns() >= deadline)
             break;
     }
+    if (sweep_cursor == sweep_end) {
+        sweep_cursor = sweep_end = 0;
+        step_state = STEP_IDLE;
+        more = 0;
+    }
+    *tail = NULL;
+    for (bp = dead; bp != NULL; bp = next) {
+        next = bp->next;
+        add_to_free_list(bp);
+    }
+    used_memory -= workers[0].freed;
+    return more;
+}
+
+/*
+ * Advance an incremental collection by about budget_ns of work. Starts a new cycle if
+ * none is running; returns nonzero while the cycle still has work left (or hasn't been
+ * able to start because a fork collection is running), 0 once it has finished. The
+ * final remark is the one step that isn't bounded, though precleaning
+ * keeps it small when soft-dirty tracking is available.
+ */
+int munch_collect_step(unsigned long long budget_ns) {
+    uint64_t deadline = now_ns() + budget_ns;
+    int more;
+
+    if (deadline < budget_ns)
+        deadline = UINT64_MAX;
+    if (my_thread == NULL)
+        munch_register_thread();
+    pthread_mutex_lock(&heap_lock);
+    if (concurrent_state != CYCLE_IDLE) {
+        /* A concurrent cycle is running; let it finish as soon as its mark is done. */
+        MAYBE_FINISH_CYCLE();
+        more = concurrent_state != CYCLE_IDLE;
+    } else
+        more = collect_step(deadline);
+    pthread_mutex_unlock(&heap_lock);
+    return more;
+}
+
+/*
+ * Choose how muncher_collect collects. Returns 0, or -1 if mode isn't one of the
+ * MUNCH_COLLECT_* modes, in which case the old one stays.
+ */
+int munch_set_collect_mode(int mode) {
+    if (mode != MUNCH_COLLECT_STOP && mode != MUNCH_COLLECT_FORK && mode != MUNCH_COLLECT_CONCURRENT)
+        return -1;
+    pthread_mutex_lock(&heap_lock);
+    collect_mode = mode;
+    pthread_mutex_unlock(&heap_lock);
+    return 0;
+}
+
+/*
+ * Write barrier slow path, for slots outside the arena: dirty the card in the large
+ * object the slot is in, if it's in one. Anything else is a root and gets scanned anyway.
+ */
+void munch_card_mark_slow(void *slot) {
+    large_obj_t *lo;
+
+    if (large_map != NULL && (lo = large_object_of((uintptr_t) slot)) != NULL)
+        lo->cards[((char *) slot - lo->addr) >> MUNCH_CARD_SHIFT] = 1;
+}
+
+/*
+ * Throw away the old generation's marks before a collection that traces everything.
+ * Called with heap_lock held.
+ */
+static void clear_sticky_marks(void) {
+    if (!sticky_marks)
+        return;
+    memset(mark_bits, 0, PAGE_INDEX(heap_frontier) * BITMAP_WORDS * sizeof(uint64_t));
+    for (large_obj_t *lo = large_objs; lo != NULL; lo = lo->next)
+        lo->marked = 0;
+    sticky_marks = 0;
+}
+
+/*
+ * Rescan the old objects on dirty cards, and clean the cards: once the minor collection
+ * is over, whatever they pointed at is old too. Only marked objects are old, and atomic
+ * ones are left out as always.
+ */
+static void scan_cards(void) {
+    uint64_t *words = (uint64_t *) munch_cards;
+    size_t ncards = (size_t) (heap_frontier - heap_lo) >> MUNCH_CARD_SHIFT;
+
+    for (size_t c = 0; c < ncards; c++) {
+        size_t first;
+
+        if ((c & 7) == 0 && c + 8 <= ncards && words[c >> 3] == 0) {
+            c += 7; /* eight clean cards at once */
+            continue;
+        }
+        if (munch_cards[c] == 0)
+            continue;
+        for (first = c; c < ncards && munch_cards[c] != 0; c++)
+            munch_cards[c] = 0;
+        for (char *lo = heap_lo + first * CARD_SIZE, *hi = heap_lo + c * CARD_SIZE, *stop; lo < hi; lo = stop) {
+            page_info_t *page = &page_table[PAGE_INDEX(lo)];
+            stop = page->base + HEAP_PAGE_SIZE < hi ? page->base + HEAP_PAGE_SIZE : hi;
+            rescan_objects(page, lo, stop);
+        }
+    }
+
+    for (large_obj_t *lo = old_large; lo != NULL; lo = lo->next) {
+        size_t n = (lo->size + CARD_SIZE - 1) >> MUNCH_CARD_SHIFT;
+
+        for (size_t c = 0; c < n; c++) {
+            if (lo->cards[c]) {
+                lo->cards[c] = 0;
+                if (!lo->noscan)
+                    rescan_part(lo->addr, lo->addr + lo->size, lo->typed,
+                                lo->addr + c * CARD_SIZE, lo->addr + (c + 1) * CARD_SIZE);
+            }
+        }
+    }
+}
+
+/*
+ * Sort a list of header_t blocks by address, so add_to_free_list can take them in one
+ * pass the way sweep does.
+ */
+static header_t *sort_blocks(header_t *list) {
+    header_t *a = NULL, *b = NULL, *next, **tail;
+
+    if (list == NULL || list->next == NULL)
+        return list;
+    for (int i = 0; list != NULL; list = next, i ^= 1) {
+        next = list->next;
+        if (i) {
+            list->next = a;
+            a = list;
+        } else {
+            list->next = b;
+            b = list;
+        }
+    }
+    a = sort_blocks(a);
+    b = sort_blocks(b);
+    for (tail = &list; a != NULL && b != NULL; tail = &(*tail)->next) {
+        if (a < b) {
+            *tail = a;
+            a = a->next;
+        } else {
+            *tail = b;
+            b = b->next;
+        }
+    }
+    *tail = a != NULL ? a : b;
+    return list;
+}
+
+/*
+ * Sweep just the nursery. Survivors keep their marks, which is what makes them old.
+ */
+static void sweep_nursery(void) {
+    header_t *dead = NULL, **tail = &dead, *bp, *next;
+    page_info_t *page;
+    large_obj_t *lo, *lo_next;
+
+    workers[0].freed = 0;
+    for (page = nursery; page != NULL; page = page->nursery_next) {
+        uint64_t *marks = &mark_bits[(page - page_table) * BITMAP_WORDS];
+
+        page->in_nursery = 0;
+        if (page->kind == PAGE_SLAB)
+            used_memory -= sweep_slab_page(page, marks, &empty_pages, class_pages);
+        else if (page->kind == PAGE_BLOCK)
+            tail = sweep_block_page(&workers[0], page, marks, tail);
+    }
+    nursery = NULL;
+    *tail = NULL;
+    for (bp = sort_blocks(dead); bp != NULL; bp = next) {
+        next = bp->next;
+        add_to_free_list(bp);
+    }
+    used_memory -= workers[0].freed;
+
+    for (lo = large_objs; lo != old_large; lo = lo_next) {
+        lo_next = lo->next;
+        if (!lo->marked)
+            free_large_object(lo);
+    }
+    old_large = large_objs;
+}
+
+/*
+ * A minor collection: trace the young generation from the roots and the dirty cards,
+ * and sweep the nursery. Called with heap_lock held.
+ */
+static void collect_minor(void) {
+    stop_world();
+    my_worker = &workers[0];
+    add_thread_roots(add_root_range);
+    add_static_roots();
+    scan_cards();
+    next_root_chunk = 0;
+    run_gc_workers(mark_worker_main);
+    num_root_chunks = 0;
+    recover_mark_overflow();
+    start_world();
+    sweep_nursery();
+}
+
+/*
+ * A full collection in generational mode: trace everything, sweep everything, and leave
+ * the marks on the survivors so they start out old.
+ */
+static void collect_major(void) {
+    sticky_marks = 1;
+    clear_sticky_marks();
+    memset(munch_cards, 0, (size_t) (heap_frontier - heap_lo) >> MUNCH_CARD_SHIFT);
+    stop_world();
+    mark();
+    start_world();
+    keep_marks = 1;
+    sweep();
+    keep_marks = 0;
+    old_large = large_objs;
+    sticky_marks = 1;
+    live_after_major = used_memory;
+}
+
+/*
+ * Minor collections until the old generation has doubled since the last full one.
+ * Called with heap_lock held.
+ */
+static void collect_generational(void) {
+    finish_lazy_sweep();
+    if (!sticky_marks || used_memory > 2 * live_after_major + ARENA_CHUNK_SIZE)
+        collect_major();
+    else
+        collect_minor();
+}
+
+void munch_set_generational(int on) {
+    pthread_mutex_lock(&heap_lock);
+    generational = on;
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
  * Mark blocks of memory in use and free the ones not in use.
  */
 void muncher_collect(void) {
-    prepare_cow_snapshot();
-    printf("going to mark\n");
-    fflush(stdout);
+    if (my_thread == NULL)
+        munch_register_thread();
+    if (collect_mode == MUNCH_COLLECT_FORK && step_state == STEP_IDLE) {
+        collect_fork();
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    wait_for_fork();
+    if (step_state != STEP_IDLE) {
+        /* Finish the incremental cycle that's under way instead. */
+        while (collect_step(UINT64_MAX))
+            ;
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    if (collect_mode == MUNCH_COLLECT_CONCURRENT && concurrent_state == CYCLE_IDLE) {
+        start_concurrent_cycle();
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+    if (concurrent_state != CYCLE_IDLE) {
+        /* Waits for the mark if it's still running. */
+        finish_concurrent_cycle();
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    if (generational) {
+        collect_generational();
+        pthread_mutex_unlock(&heap_lock);
+        return;
+    }
+
+    finish_lazy_sweep();
+    clear_sticky_marks();
+
+    /* Stopping the world also flushes every thread's buffer, so the heap is complete. */
+    stop_world();
     mark();
-    printf("going to sweep\n");
-    fflush(stdout);
+    start_world();
     sweep();
-    restore_heap_write();
+    pthread_mutex_unlock(&heap_lock);
 }
@@ -1,2 +1,74 @@
+#include <stddef.h>
+#include <stdint.h>
+
 void* munch_alloc(size_t size);
+void* munch_alloc_atomic(size_t size); /* for objects that never hold pointers */
+void* munch_calloc(size_t nmemb, size_t size);
+void* munch_realloc(void *ptr, size_t size); /* grows in place when it can */
+
+/*
+ * Precise layouts. Register the layout of a type once, as a bitmap with bit i set if word
+ * i can hold a pointer, and allocate objects of it with munch_alloc_typed; the marker then
+ * reads only those words. Objects longer than the layout repeat it.
+ */
+int munch_register_type(const uint64_t *layout, size_t nwords);
+void* munch_alloc_typed(size_t size, int type);
 void muncher_init(void);
+void munch_set_large_threshold(size_t bytes);
+void munch_set_gc_threads(int n);
+void munch_set_lazy_sweep(int on);
+void munch_set_mark_prefetch(int on); /* prefetch grey objects while marking (the default) */
+void muncher_collect(void);
+
+/*
+ * Threads whose stacks may hold the only pointer to something in the heap. Threads are
+ * registered automatically the first time they allocate, and unregistered when they exit.
+ */
+void munch_register_thread(void);
+void munch_unregister_thread(void);
+
+/*
+ * Other roots. The data and BSS segments of the executable and of every loaded library
+ * are scanned unless munch_set_data_roots(0) is called, in which case only the
+ * registered ranges are.
+ */
+int munch_add_roots(void *start, void *end);
+void munch_remove_roots(void *start, void *end);
+void munch_set_data_roots(int on);
+
+/*
+ * Which pointers keep an object alive. Programs that never hold on to an object only
+ * through a pointer into its middle can use one of the stricter policies, which cost
+ * less to check and retain less through stray values that happen to look like pointers.
+ */
+#define MUNCH_INTERIOR_ALL 0    /* any address inside it (the default) */
+#define MUNCH_INTERIOR_NONE 1   /* only the address munch_alloc returned */
+#define MUNCH_INTERIOR_PREFIX 2 /* that address or one in the first 'bytes' bytes after it */
+int munch_set_interior_pointers(int mode, size_t bytes); /* -1 for an unknown mode */
+
+#define MUNCH_COLLECT_STOP 0 /* mark and sweep with the world stopped */
+#define MUNCH_COLLECT_FORK 1 /* mark a fork()ed snapshot while the mutator runs */
+#define MUNCH_COLLECT_CONCURRENT 2 /* mark in the background, remark what was written since */
+int munch_set_collect_mode(int mode); /* -1 for an unknown mode */
+int munch_collect_step(unsigned long long budget_ns);
+
+/*
+ * Generational mode. Once it's on, every store of a pointer into a heap object has to go
+ * through MUNCH_WRITE, which dirties the card the slot is in so a minor collection finds
+ * old objects pointing at young ones.
+ */
+#define MUNCH_CARD_SHIFT 9
+extern unsigned char *munch_cards;
+extern char *munch_cards_lo, *munch_cards_hi;
+void munch_card_mark_slow(void *slot);
+void munch_set_generational(int on);
+
+#define MUNCH_WRITE(obj, field, value) \
+    do { \
+        char *munch_slot_ = (char *) &(obj)->field; \
+        (obj)->field = (value); \
+        if (munch_slot_ >= munch_cards_lo && munch_slot_ < munch_cards_hi) \
+            munch_cards[(munch_slot_ - munch_cards_lo) >> MUNCH_CARD_SHIFT] = 1; \
+        else \
+            munch_card_mark_slow(munch_slot_); \
+    } while (0)
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "../muncher.h"
+
+// Mark throughput on the linked list workload from munch_heap_test.c: build the list, keep it
+// live, and time full collections over it, once with the marker's prefetch FIFO turned off
+// and once with it on. Run as "mark_bench [nodes] [lists] [shuffle]". With more than one list
+// the nodes of all of them are interleaved in allocation order, so the marker has several
+// independent chains to overlap misses across, and with shuffle set each list is linked in
+// random order, so following a next pointer is a cache miss the way it is in a heap that has
+// seen some churn. Without a lists argument it runs one list and then 16.
+
+typedef struct Node {
+    int data;
+    struct Node* next;
+} Node;
+
+#define ROUNDS 10
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double time_collections(void) {
+    muncher_collect(); // warm up
+    double start = now_ms();
+    for (int i = 0; i < ROUNDS; ++i)
+        muncher_collect();
+    return (now_ms() - start) / ROUNDS;
+}
+
+static int bench(long nodes, int lists, int shuffle) {
+    Node **heads, **all = malloc(nodes * sizeof(Node *));
+
+    heads = (Node**)munch_alloc(lists * sizeof(Node *)); // from the GC heap, so the lists stay reachable
+    for (int l = 0; l < lists; ++l)
+        heads[l] = NULL;
+
+    for (long i = 0; i < nodes; ++i) {
+        all[i] = (Node*)munch_alloc(sizeof(Node));
+        all[i]->data = i;
+    }
+    if (shuffle) {
+        srand(1);
+        for (long i = nodes - 1; i > 0; --i) {
+            long j = ((long) rand() * RAND_MAX + rand()) % (i + 1);
+            Node *t = all[i];
+            all[i] = all[j];
+            all[j] = t;
+        }
+    }
+    for (long i = 0; i < nodes; ++i) {
+        all[i]->next = heads[i % lists];
+        heads[i % lists] = all[i];
+    }
+    free(all); // the lists are only reachable through heads now
+
+    double ms[2];
+    for (int prefetch = 0; prefetch < 2; ++prefetch) {
+        munch_set_mark_prefetch(prefetch);
+        ms[prefetch] = time_collections();
+    }
+
+    long live = 0;
+    for (int l = 0; l < lists; ++l)
+        for (Node *n = heads[l]; n != NULL; n = n->next)
+            live++;
+    for (int prefetch = 0; prefetch < 2; ++prefetch)
+        printf("%ld nodes in %d list(s)%s, prefetch %s: %.2f ms per collection, %.1f M nodes/s (%ld live)\n",
+               nodes, lists, shuffle ? ", shuffled" : "", prefetch ? "on" : "off", ms[prefetch],
+               nodes / ms[prefetch] / 1e3, live);
+    for (int l = 0; l < lists; ++l)
+        heads[l] = NULL; // garbage for the next workload
+    return live == nodes ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    long nodes = argc > 1 ? atol(argv[1]) : 1000000;
+    int shuffle = argc > 3 ? atoi(argv[3]) : 0;
+    int failed = 0;
+
+    muncher_init();
+    if (argc > 2)
+        return bench(nodes, atoi(argv[2]), shuffle);
+    failed |= bench(nodes, 1, shuffle);
+    failed |= bench(nodes, 16, shuffle);
+    return failed;
+}
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../muncher.h"
+
+// Atomic objects. Run as "munch_atomic_test <mode>", where mode is stop or generational.
+// An object from munch_alloc_atomic holds the address of another object in an integer,
+// and a normal object holds one as a pointer. After a collection the first target must
+// be gone and the second still there. In generational mode this is checked with the
+// atomic object in the old generation and a young target, with its card dirty, which is
+// what a minor collection rescans.
+//
+// An object counts as freed when allocating enough objects of its size overwrites it.
+// Addresses the test keeps for itself are disguised so that they aren't roots.
+
+#define OBJ_SIZE 64
+#define WORDS (OBJ_SIZE / sizeof(uintptr_t))
+#define MARKER 0x5a
+
+typedef struct Holder {
+    uintptr_t words[WORDS];
+} Holder;
+
+static int failed;
+static int generational;
+static Holder* atomic_holder;  // from munch_alloc_atomic
+static Holder* pointer_holder; // from munch_alloc
+static uintptr_t through_atomic, through_pointer;
+
+#define DISGUISE(p) ((uintptr_t)(p) ^ 0xffff)
+
+// Whatever the allocating frames left on the stack would keep their objects alive.
+static __attribute__((noinline)) void clear_stack(void) {
+    volatile char junk[64 * 1024];
+    for (size_t i = 0; i < sizeof(junk); ++i)
+        junk[i] = 0;
+}
+
+static __attribute__((noinline)) void store_targets(void) {
+    char* a = (char*)munch_alloc(OBJ_SIZE);
+    char* p = (char*)munch_alloc(OBJ_SIZE);
+    memset(a, MARKER, OBJ_SIZE);
+    memset(p, MARKER, OBJ_SIZE);
+    if (generational) {
+        // dirties the cards, which is all MUNCH_WRITE is there for
+        MUNCH_WRITE(atomic_holder, words[1], (uintptr_t)a);
+        MUNCH_WRITE(pointer_holder, words[1], (uintptr_t)p);
+    } else {
+        atomic_holder->words[1] = (uintptr_t)a;
+        pointer_holder->words[1] = (uintptr_t)p;
+    }
+    through_atomic = DISGUISE(a);
+    through_pointer = DISGUISE(p);
+}
+
+static __attribute__((noinline)) void reuse(size_t size, int count) {
+    for (int i = 0; i < count; ++i)
+        memset(munch_alloc(size), 0, size);
+}
+
+static int freed(uintptr_t disguised) {
+    return *(char*)DISGUISE(disguised) != MARKER;
+}
+
+int main(int argc, char** argv) {
+    const char* mode = argc > 1 ? argv[1] : "stop";
+
+    muncher_init();
+    if (strcmp(mode, "generational") == 0) {
+        generational = 1;
+        munch_set_generational(1);
+    } else if (strcmp(mode, "stop") != 0) {
+        fprintf(stderr, "unknown mode %s\n", mode);
+        return 2;
+    }
+
+    atomic_holder = (Holder*)munch_alloc_atomic(sizeof(Holder));
+    pointer_holder = (Holder*)munch_alloc(sizeof(Holder));
+    memset(atomic_holder, 0, sizeof(Holder));
+    memset(pointer_holder, 0, sizeof(Holder));
+    atomic_holder->words[0] = 42;
+    if (generational)
+        muncher_collect(); // the holders are old from here on
+
+    store_targets();
+    clear_stack();
+    muncher_collect();
+    reuse(OBJ_SIZE, 100000);
+
+    printf("%s: integer in an atomic object: target %s; pointer in a normal object: target %s\n", mode,
+           freed(through_atomic) ? "freed" : "RETAINED", freed(through_pointer) ? "LOST" : "kept");
+    if (!freed(through_atomic) || freed(through_pointer) || atomic_holder->words[0] != 42)
+        failed = 1;
+
+    printf(failed ? "FAILED\n" : "ok\n");
+    return failed;
+}
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "../muncher.h"
+
+// Interior pointer policies. Run as "munch_interior_test <policy>", where policy is all,
+// none or prefix. For a slab object, a header_t block and a large object, one object is
+// held through its start, one through a pointer 8 bytes in and one through a pointer 40
+// bytes in; each policy keeps a different subset of them alive. Also checks that an
+// unknown policy is refused and leaves the current one in place.
+//
+// A small object counts as freed when allocating enough objects of its size overwrites it,
+// a large one when its mapping is gone. Addresses the test keeps for itself are disguised
+// so that they aren't roots.
+
+#define PREFIX 16
+#define MARKER 0x5a
+
+static const size_t sizes[] = { 64, 2000, 100000 };
+static const char* kinds[] = { "slab", "block", "large" };
+static const size_t offsets[] = { 0, 8, 40 };
+
+static char* volatile holders[3][3]; // the pointers that keep the objects alive, or don't
+static uintptr_t objects[3][3];      // the objects themselves, disguised
+static int freed_objects[3][3];
+
+#define DISGUISE(p) ((uintptr_t)(p) ^ 0xffff)
+
+// Whatever the allocating frames left on the stack would keep their objects alive.
+static __attribute__((noinline)) void clear_stack(void) {
+    volatile char junk[64 * 1024];
+    for (size_t i = 0; i < sizeof(junk); ++i)
+        junk[i] = 0;
+}
+
+static __attribute__((noinline)) void allocate(void) {
+    for (int k = 0; k < 3; ++k)
+        for (int o = 0; o < 3; ++o) {
+            char* p = (char*)munch_alloc(sizes[k]);
+            memset(p, MARKER, sizes[k]);
+            holders[k][o] = p + offsets[o];
+            objects[k][o] = DISGUISE(p);
+        }
+}
+
+static __attribute__((noinline)) void reuse(size_t size, int count) {
+    for (int i = 0; i < count; ++i)
+        memset(munch_alloc(size), 0, size);
+}
+
+static int unmapped(uintptr_t disguised) {
+    return msync((void*)DISGUISE(disguised), 1, MS_ASYNC) == -1 && errno == ENOMEM;
+}
+
+int main(int argc, char** argv) {
+    const char* policy = argc > 1 ? argv[1] : "all";
+    int expect[3], failed = 0;
+
+    muncher_init();
+    if (strcmp(policy, "all") == 0) {
+        expect[0] = expect[1] = expect[2] = 1;
+        failed |= munch_set_interior_pointers(MUNCH_INTERIOR_ALL, 0) != 0;
+    } else if (strcmp(policy, "none") == 0) {
+        expect[0] = 1, expect[1] = expect[2] = 0;
+        failed |= munch_set_interior_pointers(MUNCH_INTERIOR_NONE, 0) != 0;
+    } else if (strcmp(policy, "prefix") == 0) {
+        expect[0] = expect[1] = 1, expect[2] = 0;
+        failed |= munch_set_interior_pointers(MUNCH_INTERIOR_PREFIX, PREFIX) != 0;
+    } else {
+        fprintf(stderr, "unknown policy %s\n", policy);
+        return 2;
+    }
+    if (munch_set_interior_pointers(3, 0) != -1) {
+        fprintf(stderr, "an unknown policy was accepted\n");
+        failed = 1;
+    }
+
+    allocate();
+    clear_stack();
+    muncher_collect();
+    for (int o = 0; o < 3; ++o)
+        freed_objects[2][o] = unmapped(objects[2][o]);
+    for (int k = 0; k < 2; ++k) {
+        reuse(sizes[k], k == 0 ? 100000 : 2000);
+        for (int o = 0; o < 3; ++o)
+            freed_objects[k][o] = *(char*)DISGUISE(objects[k][o]) != MARKER;
+    }
+
+    for (int k = 0; k < 3; ++k)
+        for (int o = 0; o < 3; ++o) {
+            printf("%s: %s object held %zu bytes in: %s\n", policy, kinds[k], offsets[o],
+                   freed_objects[k][o] ? "freed" : "kept");
+            if (freed_objects[k][o] == expect[o])
+                failed = 1;
+        }
+
+    printf(failed ? "FAILED\n" : "ok\n");
+    return failed;
+}
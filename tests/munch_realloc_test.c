@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "../muncher.h"
+
+// munch_calloc and munch_realloc. Run as "munch_realloc_test [mode]", with mode one of the
+// MUNCH_COLLECT_* numbers. Checks that calloc memory is zero even where the collector
+// has reused a slot, that realloc keeps the contents and the kind of an object in slab
+// slots, header_t blocks and large objects, and that whatever a grown object points to
+// survives collections. Also prints how many steps of a vector grown by half each time
+// stayed in place.
+
+typedef struct Node {
+    long data;
+    struct Node* next;
+} Node;
+
+static int failed;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+static int all_zero(const char* p, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        if (p[i] != 0)
+            return 0;
+    return 1;
+}
+
+// overwrite whatever the last collection freed
+static void reuse(size_t size) {
+    for (int i = 0; i < 100000; ++i)
+        memset(munch_alloc(size), 0x33, size);
+}
+
+static void test_calloc(void) {
+    for (int r = 0; r < 3; ++r) {
+        for (int i = 0; i < 20000; ++i)
+            memset(munch_alloc(48), 0xff, 48);
+        muncher_collect();
+        for (int i = 0; i < 20000; ++i) {
+            char* p = (char*)munch_calloc(3, 16);
+            CHECK(all_zero(p, 48));
+            memset(p, 0xee, 48);
+        }
+        for (int i = 0; i < 200; ++i)
+            memset(munch_alloc(3000), 0xff, 3000);
+        muncher_collect();
+        for (int i = 0; i < 200; ++i) {
+            char* p = (char*)munch_calloc(1, 3000);
+            CHECK(all_zero(p, 3000));
+            memset(p, 0xff, 3000);
+        }
+        CHECK(all_zero((char*)munch_calloc(1 << 20, 1), 1 << 20));
+    }
+    CHECK(munch_calloc(SIZE_MAX / 2, 4) == NULL);
+}
+
+static void test_realloc(void) {
+    char* s = (char*)munch_alloc(20);
+    strcpy(s, "hello slab");
+    CHECK(munch_realloc(s, 30) == s); // still fits its slot
+    s = (char*)munch_realloc(s, 200);
+    CHECK(strcmp(s, "hello slab") == 0);
+
+    char* b = (char*)munch_alloc(2000);
+    memset(b, 1, 2000);
+    b = (char*)munch_realloc(b, 3500);
+    CHECK(b[0] == 1 && b[1999] == 1);
+
+    char* l = (char*)munch_alloc(100000);
+    memset(l, 7, 100000);
+    CHECK(munch_realloc(l, 102000) == l); // within its mapping
+    l = (char*)munch_realloc(l, 10000000);
+    CHECK(l[0] == 7 && l[99999] == 7);
+    memset(l, 9, 10000000);
+
+    // pointers in a grown large object keep their targets alive
+    Node** arr = (Node**)munch_alloc(200000 * sizeof(Node*));
+    for (int i = 0; i < 100; ++i) {
+        arr[i] = (Node*)munch_alloc(sizeof(Node));
+        arr[i]->data = i;
+    }
+    arr = (Node**)munch_realloc(arr, 4000000 * sizeof(Node*));
+    for (int i = 100; i < 4000000; ++i)
+        arr[i] = NULL;
+    arr[3999999] = (Node*)munch_alloc(sizeof(Node));
+    arr[3999999]->data = 42;
+    for (int i = 0; i < 3; ++i)
+        muncher_collect();
+    reuse(sizeof(Node));
+    for (int i = 0; i < 100; ++i)
+        CHECK(arr[i]->data == i);
+    CHECK(arr[3999999]->data == 42);
+
+    // a typed object stays typed as a block and as a large object
+    uint64_t layout = 1 << 1; // next
+    int type = munch_register_type(&layout, 2);
+    Node* t = (Node*)munch_alloc_typed(sizeof(Node), type);
+    t->data = 5;
+    t->next = (Node*)munch_alloc(sizeof(Node));
+    t->next->data = 6;
+    t = (Node*)munch_realloc(t, 60 * sizeof(Node));
+    t[59].next = (Node*)munch_alloc(sizeof(Node));
+    t[59].next->data = 7;
+    t = (Node*)munch_realloc(t, 20000 * sizeof(Node));
+    t[19999].next = (Node*)munch_alloc(sizeof(Node));
+    t[19999].next->data = 8;
+    for (int i = 0; i < 3; ++i)
+        muncher_collect();
+    reuse(sizeof(Node));
+    CHECK(t->data == 5 && t->next->data == 6 && t[59].next->data == 7 && t[19999].next->data == 8);
+
+    char* a = (char*)munch_alloc_atomic(40);
+    strcpy(a, "atomic");
+    a = (char*)munch_realloc(a, 5000);
+    CHECK(strcmp(a, "atomic") == 0);
+
+    CHECK(munch_realloc(&failed, 10) == NULL); // not from munch_alloc
+}
+
+static void test_growth(void) {
+    size_t size = 1024;
+    int blocks = 0, in_place = 0;
+    long* v = (long*)munch_alloc(size);
+
+    memset(v, 0, size);
+    while (size < (16 << 20)) {
+        size_t new_size = size + size / 2;
+        long* w = (long*)munch_realloc(v, new_size);
+        CHECK(w != NULL && w[0] == 0 && w[size / sizeof(long) - 1] == 0);
+        if (new_size <= 64 * 1024) { // header_t blocks; larger ones are large objects
+            ++blocks;
+            in_place += w == v;
+        }
+        memset(w, 0, new_size);
+        v = w;
+        size = new_size;
+        muncher_collect();
+    }
+    printf("vector growth: %d of %d block steps in place\n", in_place, blocks);
+}
+
+int main(int argc, char** argv) {
+    muncher_init();
+    if (argc > 1 && munch_set_collect_mode(atoi(argv[1])) != 0) {
+        fprintf(stderr, "unknown mode %s\n", argv[1]);
+        return 2;
+    }
+    CHECK(munch_set_collect_mode(MUNCH_COLLECT_CONCURRENT + 1) == -1);
+
+    test_calloc();
+    test_realloc();
+    test_growth();
+
+    printf(failed ? "FAILED\n" : "ok\n");
+    return failed;
+}
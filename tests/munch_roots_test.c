@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "../muncher.h"
+
+// Roots. Run as "munch_roots_test". Checks that the very first object the heap hands out
+// is collected like any other once it's dropped: nothing the collector keeps for itself
+// may be taken for a root. Then that a range registered with munch_add_roots keeps what
+// it points to alive until munch_remove_roots, also when it's registered halfway through
+// a concurrent or incremental cycle, and that a static variable stops being a root after
+// munch_set_data_roots(0).
+//
+// A block counts as freed when allocating enough blocks of its size overwrites it, a
+// large object when its mapping is gone. Addresses the test keeps for itself are
+// disguised so that they aren't roots.
+
+#define BLOCK_SIZE 2000
+#define LARGE_SIZE 100000
+#define MARKER 0x5a
+
+static int failed;
+static uintptr_t first_obj, second_obj;
+static char* volatile data_holder; // a root for as long as the data segments are
+
+#define DISGUISE(p) (~(uintptr_t)(p)) // nowhere near the heap, even for a large object
+
+// Whatever the allocating frames left on the stack would keep their objects alive.
+static __attribute__((noinline)) void clear_stack(void) {
+    volatile char junk[64 * 1024];
+    for (size_t i = 0; i < sizeof(junk); ++i)
+        junk[i] = 0;
+}
+
+static __attribute__((noinline)) void allocate_first(void) {
+    char* a = (char*)munch_alloc(BLOCK_SIZE);
+    char* b = (char*)munch_alloc(BLOCK_SIZE);
+    memset(a, MARKER, BLOCK_SIZE);
+    memset(b, MARKER, BLOCK_SIZE);
+    first_obj = DISGUISE(a);
+    second_obj = DISGUISE(b);
+}
+
+static __attribute__((noinline)) void reuse(size_t size, int count) {
+    for (int i = 0; i < count; ++i)
+        memset(munch_alloc(size), 0, size);
+}
+
+// Out of line, so the real address never outlives the call in one of the caller's registers.
+static __attribute__((noinline)) int freed(uintptr_t disguised) {
+    return *(char*)DISGUISE(disguised) != MARKER;
+}
+
+// A new large object, pointed to from *holder only.
+static __attribute__((noinline)) uintptr_t allocate_into(char* volatile* holder) {
+    char* p = (char*)munch_alloc(LARGE_SIZE);
+    memset(p, MARKER, LARGE_SIZE);
+    *holder = p;
+    return DISGUISE(p);
+}
+
+static int unmapped(uintptr_t disguised) {
+    return msync((void*)DISGUISE(disguised), 1, MS_ASYNC) == -1 && errno == ENOMEM;
+}
+
+static int collected(uintptr_t obj) {
+    clear_stack();
+    muncher_collect();
+    return unmapped(obj);
+}
+
+static void test_first_allocation(void) {
+    allocate_first();
+    clear_stack();
+    for (int i = 0; i < 3; ++i)
+        muncher_collect();
+    reuse(BLOCK_SIZE, 2000);
+    printf("first allocation %s, second %s\n", freed(first_obj) ? "freed" : "RETAINED",
+           freed(second_obj) ? "freed" : "RETAINED");
+    if (!freed(first_obj) || !freed(second_obj))
+        failed = 1;
+}
+
+static void test_add_remove(void) {
+    // memory from malloc is nobody's root until it's registered
+    char* volatile* range = (char* volatile*)calloc(16, sizeof(char*));
+    uintptr_t obj = allocate_into(&range[5]);
+
+    if (munch_add_roots((void*)range, (void*)(range + 16)) != 0)
+        failed = 1;
+    int kept = !collected(obj);
+    munch_remove_roots((void*)range, (void*)(range + 16));
+    int dropped = collected(obj);
+    printf("registered range: %s, after removing it: %s\n", kept ? "kept" : "LOST", dropped ? "freed" : "RETAINED");
+    if (!kept || !dropped)
+        failed = 1;
+    free((void*)range);
+}
+
+// The range is registered after the cycle has scanned the roots, and nothing in it is
+// written once the cycle has started.
+static void test_add_during_cycle(const char* mode) {
+    char* volatile* range = (char* volatile*)calloc(16, sizeof(char*));
+    uintptr_t obj = allocate_into(&range[5]);
+
+    clear_stack();
+    if (strcmp(mode, "concurrent") == 0) {
+        munch_set_collect_mode(MUNCH_COLLECT_CONCURRENT);
+        muncher_collect(); // starts the cycle
+        munch_add_roots((void*)range, (void*)(range + 16));
+        muncher_collect(); // finishes it
+        munch_set_collect_mode(MUNCH_COLLECT_STOP);
+    } else {
+        munch_collect_step(1000); // starts the cycle
+        munch_add_roots((void*)range, (void*)(range + 16));
+        while (munch_collect_step(1000000))
+            ;
+    }
+    printf("range registered during a %s cycle: %s\n", mode, unmapped(obj) ? "LOST" : "kept");
+    if (unmapped(obj))
+        failed = 1;
+    munch_remove_roots((void*)range, (void*)(range + 16));
+    free((void*)range);
+}
+
+static void test_data_roots(void) {
+    uintptr_t obj = allocate_into(&data_holder);
+
+    int kept = !collected(obj);
+    munch_set_data_roots(0);
+    int dropped = collected(obj);
+    munch_set_data_roots(1);
+    printf("static variable: %s, without data roots: %s\n", kept ? "kept" : "LOST", dropped ? "freed" : "RETAINED");
+    if (!kept || !dropped)
+        failed = 1;
+}
+
+int main() {
+    muncher_init();
+
+    test_first_allocation();
+    test_add_remove();
+    test_add_during_cycle("concurrent");
+    test_add_during_cycle("step");
+    test_data_roots();
+
+    printf(failed ? "FAILED\n" : "ok\n");
+    return failed;
+}
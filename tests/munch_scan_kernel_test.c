@@ -0,0 +1,120 @@
+#define _GNU_SOURCE // as muncher.c has it, which is built in below
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// The scanning kernels. Builds muncher.c in with SCAN_HIT pointing at a recorder, then runs
+// every kernel this CPU has over the same words and checks that each one passes exactly
+// the words the plain loop does, in the same order. The bounds sit at and around 4GB
+// boundaries, where the SSE2 kernel's high-half filter is easiest to get wrong, and the
+// words are the bounds themselves, their neighbours and values that share a high half
+// with them. Buffers start at every word offset and run to every length up to a few
+// vectors, so the scalar tails after the vector loops get covered too.
+
+#define MAX_HITS 64
+
+static uintptr_t hits[MAX_HITS];
+static int num_hits;
+
+static void record_hit(uintptr_t v) {
+    if (num_hits < MAX_HITS)
+        hits[num_hits] = v;
+    num_hits++;
+}
+
+#define SCAN_HIT record_hit
+#include "../muncher.c"
+
+#define WORDS 40
+
+static const struct {
+    uintptr_t lo, span;
+} bounds[] = {
+    { 0x7f3a12345000, 0x200000000 },    // an arena-sized range
+    { 0x7f3a00000000, 0x100000000 },    // exactly one high half
+    { 0x7f39fffffff8, 0x10 },           // crosses a 4GB boundary
+    { 0x7f3afffff000, 0x1000 },         // ends right on one
+    { 0x7f3a00000000, 1 },
+    { 0x1000, 0x7fff00000000 },         // everything but the bottom and the top
+    { 0x7fffffffe000, 0x8000000000000000 }, // past the sign bit
+    { 0x7f3a12345000, 0 },
+};
+
+static uintptr_t candidates(uintptr_t lo, uintptr_t span, uintptr_t* out) {
+    uintptr_t hi = lo + span;
+    int n = 0;
+
+    out[n++] = lo - 1;
+    out[n++] = lo;
+    out[n++] = lo + 1;
+    out[n++] = hi - 1;
+    out[n++] = hi;
+    out[n++] = hi + 1;
+    out[n++] = lo & ~0xffffffffUL;          // lo's high half, below it
+    out[n++] = lo | 0xffffffffUL;           // lo's high half, possibly past hi
+    out[n++] = (hi - 1) & ~0xffffffffUL;
+    out[n++] = (hi - 1) | 0xffffffffUL;
+    out[n++] = lo + 0x100000000;
+    out[n++] = lo - 0x100000000;
+    out[n++] = lo ^ (1UL << 63);
+    out[n++] = 0;
+    out[n++] = UINTPTR_MAX;
+    out[n++] = 42;
+    return n;
+}
+
+int main() {
+    struct {
+        const char* name;
+        scan_kernel_t fn;
+    } kernels[3];
+    int nkernels = 0, failed = 0, runs = 0;
+    uintptr_t words[WORDS + 4], pool[16], expect[MAX_HITS];
+
+    kernels[nkernels].name = "scalar";
+    kernels[nkernels++].fn = scan_words;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    kernels[nkernels].name = "sse2";
+    kernels[nkernels++].fn = scan_words_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[nkernels].name = "avx2";
+        kernels[nkernels++].fn = scan_words_avx2;
+    }
+#endif
+
+    srand(7);
+    for (size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); ++b) {
+        uintptr_t lo = bounds[b].lo, span = bounds[b].span;
+        int npool = candidates(lo, span, pool);
+
+        for (int round = 0; round < 50; ++round) {
+            for (int i = 0; i < WORDS + 4; ++i)
+                words[i] = pool[rand() % npool];
+            for (int start = 0; start < 4; ++start) {
+                for (int len = 0; start + len <= WORDS; ++len) {
+                    int nexpect = 0;
+                    for (int i = start; i < start + len; ++i)
+                        if (words[i] - lo < span)
+                            expect[nexpect++] = words[i];
+                    for (int k = 0; k < nkernels; ++k) {
+                        num_hits = 0;
+                        kernels[k].fn(&words[start], &words[start + len], lo, span);
+                        runs++;
+                        if (num_hits != nexpect || memcmp(hits, expect, nexpect * sizeof(uintptr_t)) != 0) {
+                            if (!failed)
+                                fprintf(stderr, "%s: bounds %#lx+%#lx, words %d..%d: %d hits, expected %d\n",
+                                        kernels[k].name, (unsigned long)lo, (unsigned long)span, start,
+                                        start + len, num_hits, nexpect);
+                            failed = 1;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%d kernels, %d runs: %s\n", nkernels, runs, failed ? "FAILED" : "ok");
+    return failed;
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "../muncher.h"
+
+// Several threads each build a list, check it, drop it, and start over, collecting now and
+// then, so the collector runs while other threads are allocating and walking their lists.
+// Run as "munch_thread_test <mode> [threads] [rounds]", where mode is one of
+//   stop, fork, concurrent - muncher_collect in that collection mode
+//   step                   - munch_collect_step with a small budget
+//   generational           - with the next pointers stored through MUNCH_WRITE
+//   forkstep               - fork collections racing incremental steps
+//   lazy                   - stop-the-world collections with lazy sweeping, so threads
+//                            sweep pending pages as they allocate
+// A node that comes back with the wrong data was freed while its list was still live.
+
+typedef struct Node {
+    long data;
+    struct Node* next;
+    char pad[40];
+} Node;
+
+#define LIST_SIZE 500
+
+static const char *mode;
+static int rounds = 200;
+static volatile int bad;
+
+static void collect(long id) {
+    if (strcmp(mode, "step") == 0 || (strcmp(mode, "forkstep") == 0 && id % 2 == 0))
+        munch_collect_step(200000);
+    else
+        muncher_collect();
+}
+
+static void* worker(void* arg) {
+    long id = (long)arg;
+
+    for (int r = 0; r < rounds; ++r) {
+        Node* head = NULL;
+        for (int i = 0; i < LIST_SIZE; ++i) {
+            // every tenth node is a bigger one, so lists span slab pages and blocks
+            size_t size = i % 10 == 0 ? 200 + (i % 3) * 1000 : sizeof(Node);
+            Node* n = (Node*)munch_alloc(size);
+            n->data = id * LIST_SIZE + i;
+            if (strcmp(mode, "generational") == 0)
+                MUNCH_WRITE(n, next, head);
+            else
+                n->next = head;
+            head = n;
+            if (i % 100 == 0)
+                munch_alloc(100000); // a large object for the collector to drop
+        }
+        if ((r + id) % 37 == 0)
+            collect(id);
+
+        long i = LIST_SIZE - 1;
+        for (Node* n = head; n != NULL; n = n->next, --i)
+            if (n->data != id * LIST_SIZE + i) {
+                fprintf(stderr, "thread %ld round %d: node %ld holds %ld\n", id, r, i, n->data);
+                bad = 1;
+                break;
+            }
+        if (i != -1 && !bad) {
+            fprintf(stderr, "thread %ld round %d: list is %ld nodes short\n", id, r, i + 1);
+            bad = 1;
+        }
+        head = NULL; // drop the list
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    int nthreads = argc > 2 ? atoi(argv[2]) : 8;
+    pthread_t* threads;
+
+    mode = argc > 1 ? argv[1] : "stop";
+    if (argc > 3)
+        rounds = atoi(argv[3]);
+
+    muncher_init();
+    munch_set_gc_threads(2);
+    if (strcmp(mode, "fork") == 0 || strcmp(mode, "forkstep") == 0)
+        munch_set_collect_mode(MUNCH_COLLECT_FORK);
+    else if (strcmp(mode, "concurrent") == 0)
+        munch_set_collect_mode(MUNCH_COLLECT_CONCURRENT);
+    else if (strcmp(mode, "generational") == 0)
+        munch_set_generational(1);
+    else if (strcmp(mode, "lazy") == 0)
+        munch_set_lazy_sweep(1);
+    else if (strcmp(mode, "stop") != 0 && strcmp(mode, "step") != 0) {
+        fprintf(stderr, "unknown mode %s\n", mode);
+        return 2;
+    }
+
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (long i = 0; i < nthreads; ++i)
+        pthread_create(&threads[i], NULL, worker, (void*)i);
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    printf("%s: %d threads, %d rounds, %s\n", mode, nthreads, rounds, bad ? "FAILED" : "ok");
+    return bad;
+}
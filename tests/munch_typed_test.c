@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "../muncher.h"
+
+// Precise layouts. Run as "munch_typed_test <mode>", where mode is stop, fork, concurrent,
+// step or generational: arrays of 1, 200 and 50000 typed structs hold a real pointer and
+// an integer field with the address of another object in it. After a few collections and
+// enough allocation to reuse whatever was freed, the objects behind the pointers must
+// still be there and the ones behind the integers must be gone.
+//
+// Run as "munch_typed_test bench" to time full collections over 500000 structs of twelve
+// longs and a pointer, allocated with and without a layout.
+
+typedef struct Typed {
+    long id;
+    struct Typed* next;
+    uintptr_t hidden; // an address, but not a pointer as far as the layout is concerned
+} Typed;
+
+static size_t counts[] = { 1, 200, 50000 };
+static Typed* held[3];
+// the last object of each array, disguised so that they aren't roots themselves
+static uintptr_t hidden_obj[3], next_obj[3];
+
+#define DISGUISE(p) ((uintptr_t)(p) ^ 0xffff)
+
+// Whatever build's frames left on the stack would keep their objects alive.
+static __attribute__((noinline)) void clear_stack(void) {
+    volatile char junk[64 * 1024];
+    for (size_t i = 0; i < sizeof(junk); ++i)
+        junk[i] = 0;
+}
+
+static __attribute__((noinline)) void build(int type, int generational) {
+    for (int s = 0; s < 3; ++s) {
+        Typed* a = (Typed*)munch_alloc_typed(counts[s] * sizeof(Typed), type);
+        for (size_t i = 0; i < counts[s]; ++i) {
+            char* h = (char*)munch_alloc(64);
+            char* k = (char*)munch_alloc(64);
+            memset(h, 0x5a, 64);
+            memset(k, 0x6b, 64);
+            a[i].id = i;
+            if (generational)
+                MUNCH_WRITE(&a[i], next, (Typed*)k);
+            else
+                a[i].next = (Typed*)k;
+            a[i].hidden = (uintptr_t)h;
+            hidden_obj[s] = DISGUISE(h);
+            next_obj[s] = DISGUISE(k);
+        }
+        held[s] = a;
+    }
+}
+
+static void collect(const char* mode) {
+    if (strcmp(mode, "step") == 0)
+        while (munch_collect_step(1000000))
+            ;
+    else
+        muncher_collect();
+}
+
+static int retention(const char* mode) {
+    uint64_t layout = 1 << 1; // only word 1, next, is a pointer
+    int type, bad = 0;
+
+    if (strcmp(mode, "fork") == 0)
+        munch_set_collect_mode(MUNCH_COLLECT_FORK);
+    else if (strcmp(mode, "concurrent") == 0)
+        munch_set_collect_mode(MUNCH_COLLECT_CONCURRENT);
+    else if (strcmp(mode, "generational") == 0)
+        munch_set_generational(1);
+    else if (strcmp(mode, "stop") != 0 && strcmp(mode, "step") != 0) {
+        fprintf(stderr, "unknown mode %s\n", mode);
+        return 2;
+    }
+
+    type = munch_register_type(&layout, 3);
+    if (munch_alloc_typed(8, type + 1) != NULL) {
+        fprintf(stderr, "an unregistered type id was accepted\n");
+        bad = 1;
+    }
+    build(type, strcmp(mode, "generational") == 0);
+    clear_stack();
+    for (int i = 0; i < 3; ++i)
+        collect(mode);
+    for (int r = 0; r < 200000; ++r)
+        memset(munch_alloc(64), 0, 64);
+
+    for (int s = 0; s < 3; ++s) {
+        char* h = (char*)DISGUISE(hidden_obj[s]);
+        char* k = (char*)DISGUISE(next_obj[s]);
+        int ids = 1;
+        for (size_t i = 0; i < counts[s]; ++i)
+            if (held[s][i].id != (long)i)
+                ids = 0;
+        printf("%s, %zu structs: ids %s, next %s, hidden %s\n", mode, counts[s],
+               ids ? "ok" : "BAD", k[0] == 0x6b ? "kept" : "LOST", h[0] == 0x5a ? "RETAINED" : "freed");
+        if (!ids || k[0] != 0x6b || h[0] == 0x5a)
+            bad = 1;
+    }
+    return bad;
+}
+
+typedef struct Record {
+    long fields[12];
+    struct Record* next;
+} Record;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void bench(void) {
+    uint64_t layout = 1ULL << 12; // next
+    int type = munch_register_type(&layout, 13);
+    Record** heads = (Record**)munch_alloc(2 * 64 * sizeof(Record*));
+
+    for (int typed = 0; typed < 2; ++typed) {
+        Record** lists = heads + typed * 64;
+        for (long i = 0; i < 500000; ++i) {
+            Record* n = (Record*)(typed ? munch_alloc_typed(sizeof(Record), type) : munch_alloc(sizeof(Record)));
+            for (int k = 0; k < 12; ++k)
+                n->fields[k] = i * 7 + k;
+            n->next = lists[i % 64];
+            lists[i % 64] = n;
+        }
+        muncher_collect();
+        double start = now_ms();
+        for (int i = 0; i < 10; ++i)
+            muncher_collect();
+        printf("%s: %.2f ms per collection\n", typed ? "typed" : "conservative", (now_ms() - start) / 10);
+        for (int l = 0; l < 64; ++l)
+            lists[l] = NULL;
+    }
+}
+
+int main(int argc, char** argv) {
+    const char* mode = argc > 1 ? argv[1] : "stop";
+
+    muncher_init();
+    if (strcmp(mode, "bench") == 0) {
+        bench();
+        return 0;
+    }
+    return retention(mode);
+}